@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+#
+# Compares the reverse proxy with pooled upstream connections (UPSTREAM_POOL_SIZE as in main.c) against
+# the same build without a pool (UPSTREAM_POOL_SIZE 0). A keep-alive stand-in backend runs in this
+# process, and every run sends sequential requests to GET /api/x through the proxy over loopback:
+#
+#   python3 benchmark_proxy.py [requests per run] [runs]
+
+import http.server
+import os
+import re
+import socket
+import socketserver
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+class StandInHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    # Without it the backend delays small responses on kept-alive connections (Nagle and delayed ACK)
+    disable_nagle_algorithm = True
+
+    def log_message(self, *arguments):
+        pass
+
+    def do_GET(self):
+        body = b"stand-in response\n"
+        self.send_response(200)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+
+class StandInBackend(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+def free_port():
+    with socket.socket() as probe:
+        probe.bind(("127.0.0.1", 0))
+        return probe.getsockname()[1]
+
+
+def build(directory, pool_size):
+    with open("main.c") as source:
+        code = re.sub(r"(?m)^#define UPSTREAM_POOL_SIZE .*$", "#define UPSTREAM_POOL_SIZE %d" % pool_size, source.read())
+    source_path = os.path.join(directory, "main_%d.c" % pool_size)
+    executable = os.path.join(directory, "main_%d" % pool_size)
+    with open(source_path, "w") as copy:
+        copy.write(code)
+    subprocess.check_call(["gcc", "-O2", "-o", executable, source_path, "-lpthread"])
+    return executable
+
+
+def measure(port, count):
+    request = b"GET /api/x HTTP/1.1\r\nHost: localhost\r\n\r\n"
+    latencies = []
+    started = time.perf_counter()
+    for _ in range(count):
+        sent = time.perf_counter()
+        with socket.create_connection(("127.0.0.1", port)) as client:
+            client.sendall(request)
+            while client.recv(65536):
+                pass
+        latencies.append(time.perf_counter() - sent)
+    elapsed = time.perf_counter() - started
+    latencies.sort()
+    return count / elapsed, latencies[count // 2] * 1e6, latencies[int(count * 0.99)] * 1e6
+
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 3000
+    runs = int(sys.argv[2]) if len(sys.argv) > 2 else 2
+
+    backend = StandInBackend(("127.0.0.1", 0), StandInHandler)
+    threading.Thread(target=backend.serve_forever, daemon=True).start()
+    route = "--route=/api/ 127.0.0.1:%d" % backend.server_address[1]
+
+    with tempfile.TemporaryDirectory() as directory:
+        pool_size = int(re.search(r"(?m)^#define UPSTREAM_POOL_SIZE (\d+)", open("main.c").read()).group(1))
+        for size in (pool_size, 0):
+            executable = build(directory, size)
+            for _ in range(runs):
+                port = free_port()
+                server = subprocess.Popen([executable, "--port=%d" % port, "--public_folder=" + directory, route],
+                                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+                time.sleep(0.5)
+                try:
+                    measure(port, 100)
+                    throughput, p50, p99 = measure(port, count)
+                finally:
+                    server.terminate()
+                    server.wait()
+                print("UPSTREAM_POOL_SIZE %2d: %5.0f req/s, p50 %4.0f us, p99 %5.0f us" % (size, throughput, p50, p99))
+
+    backend.shutdown()
+
+
+if __name__ == "__main__":
+    main()
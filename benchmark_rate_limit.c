@@ -0,0 +1,91 @@
+/*
+ * Measures the cost of a rate limit lookup (take_rate_limit_token) with one
+ * and with four threads. The server is compiled in, so the numbers come from
+ * the same table code:
+ *
+ *   gcc -O2 -o benchmark_rate_limit benchmark_rate_limit.c -lpthread
+ *   ./benchmark_rate_limit <entries> <keys> <adversarial (0 or 1)> <lookups per thread>
+ *
+ * For example "4194304 4194304 0 20000000" fits every key in the table,
+ * "4194304 16777216 0 20000000" keeps evicting, and "4194304 64 1 20000000"
+ * makes every key hash to the same set.
+ */
+#define main server_main
+#include "main.c"
+#undef main
+
+unsigned char (* benchmark_keys)[16];
+long benchmark_key_count;
+long benchmark_lookups;
+
+/**
+ * Returns the current monotonic time in nanoseconds.
+ */
+uint64_t monotonic_nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Looks up keys picked with a xorshift generator seeded by the thread index,
+ * with a rate high enough that every lookup is allowed.
+ *
+ * @param argument the index of the thread
+ *
+ * @return <I>NULL</I>
+ */
+void * look_up_keys(void * argument) {
+    uint64_t state = (uint64_t) (long) argument * 7919 + 1;
+    for(long i = 0; i < benchmark_lookups; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        take_rate_limit_token(benchmark_keys[state % benchmark_key_count], 0, 1000000, 1000000);
+    }
+    return NULL;
+}
+
+/**
+ * Runs the lookups on the given number of threads.
+ *
+ * @return the average time of a lookup in nanoseconds
+ */
+double run_lookups(int thread_count) {
+    pthread_t threads[thread_count];
+    uint64_t started = monotonic_nanoseconds();
+    for(long i = 0; i < thread_count; i++) pthread_create(&threads[i], NULL, look_up_keys, (void *) i);
+    for(int i = 0; i < thread_count; i++) pthread_join(threads[i], NULL);
+    return (double) (monotonic_nanoseconds() - started) / (benchmark_lookups * thread_count);
+}
+
+int main(int argc, char * argv[]) {
+    if(argc != 5) {
+        printf("Usage: %s <entries> <keys> <adversarial> <lookups per thread>\n", argv[0]);
+        return 1;
+    }
+    configuration.rate_limit_entries = atoi(argv[1]);
+    benchmark_key_count = atol(argv[2]);
+    bool adversarial = atoi(argv[3]) != 0;
+    benchmark_lookups = atol(argv[4]);
+    if(create_rate_limit_table() != 0) return 1;
+
+    // IPv4 mapped addresses, like the ones the server builds for IPv4 clients
+    benchmark_keys = malloc(benchmark_key_count * 16);
+    if(benchmark_keys == NULL) return 1;
+    uint32_t counter = 0;
+    for(long i = 0; i < benchmark_key_count; i++) {
+        do {
+            memset(benchmark_keys[i], 0, 16);
+            benchmark_keys[i][10] = 0xff;
+            benchmark_keys[i][11] = 0xff;
+            uint32_t address = ++counter * 2654435761u;
+            memcpy(benchmark_keys[i] + 12, &address, 4);
+        } while(adversarial && hash_rate_limit_key(benchmark_keys[i], 0) % rate_limit_table.set_count != 0);
+    }
+    for(long i = 0; i < benchmark_key_count; i++) take_rate_limit_token(benchmark_keys[i], 0, 1000000, 1000000);
+
+    printf("entries %s, keys %s%s: 1 thread %.1f ns/lookup, 4 threads %.1f ns/lookup\n", argv[1], argv[2],
+           adversarial ? " (one set)" : "", run_lookups(1), run_lookups(4));
+    return 0;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
@@ -10,6 +12,48 @@
 #include <fcntl.h>
 #include <semaphore.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <linux/openat2.h>
+#include <sched.h>
+#include <dirent.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Request stages are exposed as USDT probes (http_server:stage) when systemtap's headers are installed
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(id, stage) DTRACE_PROBE2(http_server, stage, id, stage)
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(id, stage) ((void) 0)
+#endif
+
+#ifdef ENABLE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+// Kernel TLS (and SSL_sendfile) needs OpenSSL 3.0, older versions always encrypt in user space
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define ENABLE_KTLS
+#endif
+#endif
 
 /**
  * A simple HTTP server implementation in C using RFC2616 (https://tools.ietf.org/html/rfc2616).
@@ -17,6 +61,16 @@
  * <B>FEATURES</B>:
  * - Static resources serving (capable of serving static file resources like html, css, js, jpeg and svg files).
  * - Multi-threaded handling of requests.
+ * - Idle, header, body and minimum send rate timeouts for every connection (enforced by a timer wheel).
+ * - Reverse proxy routes to TCP or Unix socket upstreams, with pooled keep-alive upstream connections.
+ * - Optional HTTPS with session resumption and kernel TLS offload, so files are still sent with sendfile.
+ * - Runtime configuration, and zero-downtime reloads and upgrades handing the listening sockets over (SIGHUP).
+ * - Per-client (and per-route) token bucket rate limiting with bounded memory.
+ * - Listening on a Unix domain socket (filesystem or abstract), along with or instead of TCP.
+ * - Tuned connection setup: batched accepts, deferred accepts, TCP Fast Open and CPU affinity of the handlers.
+ * - Optional page cache warm-up before accepting connections, crawling the public folder in parallel.
+ * - Shared pool of I/O buffers, only checked out while a connection has data to receive or send.
+ * - Sampled per-request stage tracing, dumped on SIGUSR1 and convertible to Chrome trace / Perfetto JSON.
  *
  * <B>TO-DO</B>:
  * - Fix memory leaks (with valgrind) and ensure all dynamic memory is deallocated when unnecesary.
@@ -34,14 +88,140 @@
  * And a lot of more stuff which will probably get refactored whenever I feel like I wanting to suffer :D
  */
 
+// Default configuration, every value can be overridden from a configuration file or the command line
 #define PUBLIC_FOLDER "/home/server/public"
 #define PORT_NUMBER 8080
 #define BUFFER_SIZE 4096
 #define MAX_CONNECTIONS 20
+// Length of the queue of connections waiting to be accepted, seconds the kernel holds a connection back until
+// its first bytes arrive (0 disables it), length of the TCP Fast Open queue (0 disables it), and whether every
+// connection is handled on the CPU that received its packets (1) or on any of them (0); pinning is off by
+// default since with a single receive queue (or RPS off) it would put every handler on one CPU
+#define LISTEN_BACKLOG 511
+#define DEFER_ACCEPT_SECONDS 5
+#define FAST_OPEN_QUEUE 256
+#define INCOMING_CPU_AFFINITY 0
+// Unix domain socket to also listen on (NULL disables it, a leading '@' means the abstract namespace), and
+// permissions of its file; setting the port to 0 disables the TCP listener
+#define UNIX_SOCKET_PATH NULL
+#define UNIX_SOCKET_MODE 0660
+// Maximum time a replaced process keeps serving its open connections after a reload
+#define DRAIN_TIMEOUT_MS 60000
+// Requests per second and burst allowed for every client address (0 disables the limit), and maximum
+// number of rate limiting buckets kept in memory (the least recently used ones are evicted)
+#define RATE_LIMIT_RATE 0
+#define RATE_LIMIT_BURST 0
+#define RATE_LIMIT_ENTRIES 65536
+// One in every TRACE_SAMPLE_RATE requests is traced (0 disables sampling), as well as every request
+// slower than TRACE_SLOW_MS milliseconds (0 disables it); every CPU keeps its last TRACE_BUFFER_RECORDS
+// traces, written to TRACE_FILE on SIGUSR1
+#define TRACE_SAMPLE_RATE 0
+#define TRACE_SLOW_MS 0
+#define TRACE_BUFFER_RECORDS 4096
+#define TRACE_FILE "/tmp/http-server-trace.bin"
+// Megabytes of public files prefetched into the page cache before accepting connections (0 disables the
+// warm-up), number of threads crawling the public folder, maximum time the warm-up can take, and an optional
+// file listing the hottest request paths (one per line, access logs work too), which are prefetched first
+#define WARM_UP_BUDGET 0
+#define WARM_UP_THREADS 4
+#define WARM_UP_TIMEOUT_MS 10000
+#define WARM_UP_MANIFEST NULL
+// Bytes of a file read ahead at once during the warm-up, so a large file can not run past the deadline
+#define WARM_UP_CHUNK_SIZE (2 * 1024 * 1024)
+// Environment variable telling a new process which descriptor to receive the listening sockets from
+#define HANDOFF_VARIABLE "HTTP_SERVER_HANDOFF_FD"
+// Maximum number of listening sockets the server accepts connections from
+#define MAX_LISTENERS 4
+// Maximum number of connections accepted from a listener before checking the other ones
+#define ACCEPT_BATCH_SIZE 64
+// Maximum number of idle I/O buffers kept for reuse (the rest are freed), and maximum number of
+// buffers chained to receive the headers of a single request
+#define BUFFER_POOL_SIZE 64
+#define MAX_MESSAGE_BUFFERS 8
+// Maximum number of file bytes handed to the kernel by every sendfile call
+#define SEND_FILE_CHUNK_SIZE 65536
+
+// HTTPS is served on its own port when the server is compiled with -DENABLE_TLS (linking -lssl -lcrypto),
+// using the given PEM certificate chain and private key (a TLS port of 0 disables it)
+#define TLS_PORT_NUMBER 8443
+#define TLS_CERTIFICATE_FILE "/home/server/tls/certificate.pem"
+#define TLS_PRIVATE_KEY_FILE "/home/server/tls/private_key.pem"
+// Number of sessions kept in the server side session cache and how long they can be resumed (seconds)
+#define TLS_SESSION_CACHE_SIZE 20480
+#define TLS_SESSION_TIMEOUT 3600
+
+// Timer wheel resolution, every tick advances the lowest level of the wheel by one slot
+#define TIMER_TICK_MS 100
+// Levels and slots per level of the wheel (4 levels of 64 slots cover 64^4 ticks, around 19 days)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Maximum time a new connection may stay open before sending the first byte of a request
+#define IDLE_TIMEOUT_MS 5000
+// Maximum time between the first byte of a request and the end of its headers
+#define HEADER_TIMEOUT_MS 10000
+// Maximum time to receive the request body once the headers are complete
+#define BODY_TIMEOUT_MS 10000
+// Grace period for a response plus the minimum rate (bytes per second) the client must read it at
+#define SEND_TIMEOUT_MS 10000
+#define MIN_SEND_RATE 4096
+
+// Reverse proxy routes, each one is "<uri prefix> <upstream>[,<upstream>...]" where an upstream is
+// either "host:port" or "unix:/path/to/socket" (e.g. { "/api/ 127.0.0.1:9000,127.0.0.1:9001", NULL })
+#define PROXY_ROUTES { NULL }
+// Maximum number of idle keep-alive connections kept open for every upstream
+#define UPSTREAM_POOL_SIZE 32
+// Maximum time to establish a connection to an upstream
+#define UPSTREAM_CONNECT_TIMEOUT_MS 3000
+// Maximum time an upstream may stall while sending a response or receiving a request
+#define UPSTREAM_TIMEOUT_MS 30000
+// Consecutive failures after which an upstream is skipped, and for how long
+#define UPSTREAM_MAX_FAILS 3
+#define UPSTREAM_FAIL_TIMEOUT_MS 10000
+// Maximum number of bytes moved by every splice call while proxying
+#define PROXY_SPLICE_SIZE 65536
+
+// Buckets per set of the rate limiting table (a key can only live in the set it hashes to),
+// and number of locks the sets are striped over
+#define RATE_LIMIT_WAYS 8
+#define RATE_LIMIT_LOCKS 256
+
+// Stages timestamped for every request, in the order they are reached
+#define TRACE_ACCEPT 0
+#define TRACE_FIRST_BYTE 1
+#define TRACE_PARSED 2
+#define TRACE_MIME_RESOLVED 3
+#define TRACE_LOCK_ACQUIRED 4
+#define TRACE_FILE_OPENED 5
+#define TRACE_HEADERS_SENT 6
+#define TRACE_LAST_BYTE 7
+#define TRACE_STAGE_COUNT 8
+// Identifies the trace files written by the server
+#define TRACE_MAGIC "HTTPTRC1"
 
 typedef struct header HttpHeader;
 typedef struct request HttpRequest;
 typedef struct mime HttpMimeType;
+typedef struct timer Timer;
+typedef struct timer_wheel TimerWheel;
+typedef struct connection HttpConnection;
+typedef struct listener HttpListener;
+typedef struct configuration HttpConfiguration;
+typedef struct rate_limit_entry HttpRateLimitEntry;
+typedef struct rate_limit_table HttpRateLimitTable;
+typedef struct rate_limit_route HttpRateLimitRoute;
+typedef struct upstream HttpUpstream;
+typedef struct upstream_connection HttpUpstreamConnection;
+typedef struct route HttpRoute;
+typedef struct chunk_tracker HttpChunkTracker;
+typedef struct buffer HttpBuffer;
+typedef struct buffer_pool HttpBufferPool;
+typedef struct warm_up HttpWarmUp;
+typedef struct trace_record HttpTraceRecord;
+typedef struct trace_ring HttpTraceRing;
+typedef struct trace_header HttpTraceHeader;
 
 struct header {
     char * name;
@@ -63,15 +243,264 @@ struct mime {
     bool binary;
 };
 
+struct timer {
+    uint64_t expires;
+    int socket_descriptor;
+    const char * deadline;
+    bool expired;
+    struct timer * next;
+    // Address of the pointer referencing this timer in its slot (NULL when not armed)
+    struct timer ** link;
+};
+
+struct timer_wheel {
+    uint64_t current;
+    struct timer * slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    pthread_mutex_t mutex;
+};
+
+struct connection {
+    int socket_descriptor;
+    // Client address as used by rate limiting (only when has_client_address is set)
+    unsigned char client_address[16];
+    bool has_client_address;
+    struct timer timer;
+    uint64_t send_started;
+    // When the last write to the client finished, if the connection is waiting for something else to send since
+    uint64_t send_paused;
+    uint64_t bytes_sent;
+    // Timestamps of the stages reached by the current request (0 for the ones not reached)
+    uint64_t trace_id;
+    uint64_t trace_stages[TRACE_STAGE_COUNT];
+    int status_code;
+#ifdef ENABLE_TLS
+    // TLS session of the connection (NULL for plaintext connections), and whether the kernel
+    // took over the symmetric crypto in each direction after the handshake
+    SSL * tls;
+    bool ktls_send;
+    bool ktls_receive;
+#endif
+};
+
+struct listener {
+    int socket_descriptor;
+    bool tls;
+};
+
+struct configuration {
+    char * public_folder;
+    int port;
+    int buffer_size;
+    int max_connections;
+    int listen_backlog;
+    int defer_accept;
+    int fast_open_queue;
+    int incoming_cpu_affinity;
+    char * unix_socket;
+    int unix_socket_mode;
+    int drain_timeout;
+    int tls_port;
+    char * tls_certificate;
+    char * tls_private_key;
+    int rate_limit_rate;
+    int rate_limit_burst;
+    int rate_limit_entries;
+    int trace_sample_rate;
+    int trace_slow_ms;
+    int trace_buffer_records;
+    char * trace_file;
+    int warm_up_budget;
+    int warm_up_threads;
+    int warm_up_timeout;
+    char * warm_up_manifest;
+};
+
+struct rate_limit_entry {
+    unsigned char address[16];
+    uint32_t route;
+    // Last time the bucket was refilled (0 for unused buckets), also used to find the least recently used one
+    uint64_t updated;
+    // Available requests, in thousandths of a request
+    int64_t tokens;
+};
+
+struct rate_limit_table {
+    struct rate_limit_entry * entries;
+    uint64_t set_count;
+    uint64_t seed;
+    pthread_mutex_t locks[RATE_LIMIT_LOCKS];
+};
+
+struct rate_limit_route {
+    char * prefix;
+    uint32_t id;
+    int rate;
+    int burst;
+    struct rate_limit_route * next;
+};
+
+struct upstream {
+    char * name;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    // Health state, an upstream is skipped until retry_after after failing too many times in a row
+    int failures;
+    uint64_t retry_after;
+    // Pool of idle keep-alive connections
+    struct upstream_connection * idle;
+    int idle_count;
+    pthread_mutex_t mutex;
+};
+
+struct upstream_connection {
+    int socket_descriptor;
+    struct timer timer;
+    struct upstream_connection * next;
+};
+
+struct route {
+    char * prefix;
+    struct upstream * upstreams;
+    int upstream_count;
+    unsigned int next_upstream;
+    struct route * next;
+};
+
+struct chunk_tracker {
+    int state;
+    long remaining;
+    bool done;
+};
+
+struct buffer {
+    // Next buffer of a chain holding a single message
+    struct buffer * next;
+    int length;
+    // Size of the data (the pooled buffers have buffer_size bytes, plus room for a terminator)
+    int capacity;
+    char data[];
+};
+
+struct buffer_pool {
+    struct buffer * idle;
+    int idle_count;
+    // Buffers allocated in total and checked out right now, and the highest number ever checked out
+    int allocated;
+    int in_use;
+    int peak_in_use;
+    pthread_mutex_t mutex;
+};
+
+struct warm_up {
+    // Directories (relative to the public folder) waiting to be crawled, and number of threads crawling one
+    char ** directories;
+    int directory_count;
+    int directory_capacity;
+    int active;
+    // Inodes of the files already prefetched from the manifest (sorted), skipped by the crawl
+    uint64_t * prefetched;
+    int prefetched_count;
+    int prefetched_capacity;
+    // Bytes that can still be prefetched
+    int64_t budget;
+    uint64_t deadline;
+    int64_t files;
+    int64_t bytes;
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+};
+
+struct trace_record {
+    uint64_t id;
+    uint64_t stages[TRACE_STAGE_COUNT];
+    uint32_t thread;
+    uint16_t status_code;
+    uint16_t slow;
+};
+
+struct trace_ring {
+    struct trace_record * records;
+    // Number of records ever written, the next one goes to head % trace_buffer_records
+    uint64_t head;
+    pthread_mutex_t mutex;
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t stage_count;
+    uint32_t reserved;
+    double ticks_per_microsecond;
+    uint64_t record_count;
+};
+
 
 // GLOBAL VARIABLES
 
+// Runtime configuration, loaded once at startup (a reload starts a new process)
+HttpConfiguration configuration = {
+    PUBLIC_FOLDER, PORT_NUMBER, BUFFER_SIZE, MAX_CONNECTIONS,
+    LISTEN_BACKLOG, DEFER_ACCEPT_SECONDS, FAST_OPEN_QUEUE, INCOMING_CPU_AFFINITY,
+    UNIX_SOCKET_PATH, UNIX_SOCKET_MODE, DRAIN_TIMEOUT_MS,
+    TLS_PORT_NUMBER, TLS_CERTIFICATE_FILE, TLS_PRIVATE_KEY_FILE,
+    RATE_LIMIT_RATE, RATE_LIMIT_BURST, RATE_LIMIT_ENTRIES,
+    TRACE_SAMPLE_RATE, TRACE_SLOW_MS, TRACE_BUFFER_RECORDS, TRACE_FILE,
+    WARM_UP_BUDGET, WARM_UP_THREADS, WARM_UP_TIMEOUT_MS, WARM_UP_MANIFEST
+};
+
+// Token buckets of the rate limited clients, and routes with their own per-client limits
+HttpRateLimitTable rate_limit_table;
+HttpRateLimitRoute * rate_limit_routes = NULL;
+
 // Keeps track of the current number of connections
 int current_connections = 0;
 
 // Controls threading actions (i.e. no multiple threads accesing disk)
 sem_t lock;
 
+// Enforces the idle, header, body and send deadlines of all the open connections
+TimerWheel timer_wheel;
+
+// I/O buffers shared by all the connections
+HttpBufferPool buffer_pool = { NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// Reverse proxy routes, checked in order before serving static files
+HttpRoute * routes = NULL;
+
+// Sockets the server accepts connections from
+HttpListener listeners[MAX_LISTENERS];
+int listener_count = 0;
+
+// Listening sockets received from the process being replaced, claimed by the matching listeners
+int inherited_listeners[MAX_LISTENERS];
+int inherited_listener_count = 0;
+
+// Public folder opened once at startup, every requested file is resolved beneath it
+int public_folder_descriptor = -1;
+
+// Number of accepted connections not closed yet (a replaced process exits once it drops to zero)
+int open_connections = 0;
+
+// Set by SIGHUP, asks the accept loop to start a new process and hand the listening sockets over
+volatile sig_atomic_t reload_requested = 0;
+
+// Set by SIGUSR1, asks the accept loop to print the buffer statistics and write the collected request traces
+volatile sig_atomic_t dump_requested = 0;
+
+// Per-CPU ring buffers of the traced requests (NULL while tracing is disabled), and the measured
+// frequency of the timestamp counter. Handler threads only live for one connection, so the rings
+// belong to CPUs rather than threads.
+HttpTraceRing * trace_rings = NULL;
+int trace_ring_count = 0;
+double trace_ticks_per_microsecond = 1;
+
+// Identifier of the last accepted connection
+uint64_t trace_sequence = 0;
+
+#ifdef ENABLE_TLS
+// Shared configuration (certificate, session cache and ticket keys) of all the TLS connections
+SSL_CTX * tls_context = NULL;
+#endif
+
 
 /**
  * Returns a pointer to a new allocated <B>HttpHeader</B> structure, with
@@ -311,9 +740,10 @@ HttpRequest * parse_http_request(char * message, int * status) {
                 || (* traversal) == ':'
                 || (* traversal) == '@'
                 || (* traversal) == '%'
+                || (* traversal) == '?'
                 || (* traversal) == '/';
         // Prevent two dots in a row (most common vulnerability is trying to access unauthorized dirs with ../../)
-        is_valid_uri = !(previous_char == '.' && previous_char == (* traversal));
+        is_valid_uri = is_valid_uri && !(previous_char == '.' && previous_char == (* traversal));
         previous_char = (* traversal);
         traversal++;
     }
@@ -633,279 +1063,3204 @@ char * concat_strings(char * first, char * second) {
 }
 
 /**
- * Sends an http header response and status using the specificied socket
- * descriptor. If the response does not involve sending a file pass
- * <I>NULL</I> to the mime type.
- *
- * @param socket_descriptor the descriptor of a open socket
- * @param http_status_code an http status code
- * @param mime_type a mime type that represents the content of a file to be sent
+ * Returns the milliseconds elapsed on the monotonic clock, which unlike
+ * the wall clock never jumps backwards.
  *
- * @return 0 if the sending was successful and 1 otherwise.
+ * @return the current monotonic time in milliseconds
  */
-int send_http_header(int socket_descriptor, int http_status_code, HttpMimeType * mime_type) {
-    if(http_status_code == 200) {
-
-        // I need a variadic function for concatenation or maybe a library
-        // for strings which I don't have right now, when I'll feel like
-        // wanting to suffer I'll code one, but for now we have this messy
-        // concatenation.
+uint64_t monotonic_milliseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-        char * response = strdup("HTTP/1.1 200 OK\r\nContent-Type: ");
-        char * concat = concat_strings(response, mime_type->mime);
-        free(response);
-        response = concat_strings(concat, "\r\n\r\n");
-        free(concat);
+/**
+ * Links the given timer into the slot of the wheel that corresponds to its
+ * expiration tick. Timers closer than 64 ticks go to the lowest level, and
+ * every next level covers 64 times more ticks than the previous one.
+ *
+ * The wheel mutex must be held by the caller.
+ *
+ * @param timer a pointer to a <B>Timer</B> that is not linked
+ */
+void link_timer(Timer * timer) {
+    static const uint64_t MAX_DELTA = ((uint64_t) 1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
 
-        send(socket_descriptor, response, strlen(response), 0);
-        free(response);
+    if(timer->expires <= timer_wheel.current) timer->expires = timer_wheel.current + 1;
+    if(timer->expires - timer_wheel.current > MAX_DELTA) timer->expires = timer_wheel.current + MAX_DELTA;
 
-        return 0;
-    } else if(http_status_code == 400) {
-        char * response = strdup("HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n");
-        send(socket_descriptor, response, strlen(response), 0);
-        free(response);
+    uint64_t delta = timer->expires - timer_wheel.current;
+    int level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t) 1 << ((level + 1) * TIMER_WHEEL_BITS))) {
+        level++;
+    }
 
-        return 0;
-    } else if(http_status_code == 404) {
-        char * response = strdup("HTTP/1.1 404 Not Found\r\nConnection: close\r\n\r\n");
-        send(socket_descriptor, response, strlen(response), 0);
-        free(response);
+    int slot = (timer->expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+    Timer ** head = &timer_wheel.slots[level][slot];
+    timer->next = (* head);
+    if(timer->next != NULL) timer->next->link = &timer->next;
+    timer->link = head;
+    (* head) = timer;
+}
 
-        return 0;
-    } else if(http_status_code == 503) {
-        char * response = strdup("HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n");
-        send(socket_descriptor, response, strlen(response), 0);
-        free(response);
+/**
+ * Removes the given timer from the slot it is linked into. If the timer is
+ * not linked nothing is done.
+ *
+ * The wheel mutex must be held by the caller.
+ *
+ * @param timer a pointer to a <B>Timer</B>
+ */
+void unlink_timer(Timer * timer) {
+    if(timer->link == NULL) return;
+    (* timer->link) = timer->next;
+    if(timer->next != NULL) timer->next->link = timer->link;
+    timer->next = NULL;
+    timer->link = NULL;
+}
 
-        return 0;
+/**
+ * Arms (or re-arms if it was already armed) the given timer so it expires at
+ * the given monotonic time. When a timer expires its socket is shut down,
+ * which wakes up any thread blocked reading from or writing to it.
+ *
+ * Arming, re-arming and cancelling take constant time.
+ *
+ * @param timer a pointer to a <B>Timer</B>
+ * @param deadline the monotonic time in milliseconds at which the timer expires
+ * @param name the name of the deadline being enforced (used for reporting)
+ */
+void arm_timer(Timer * timer, uint64_t deadline, const char * name) {
+    uint64_t expires = (deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    pthread_mutex_lock(&timer_wheel.mutex);
+    timer->deadline = name;
+    // Re-arming on every read or write usually lands on the same tick, avoid touching the wheel then
+    if(timer->link == NULL || timer->expires != expires) {
+        unlink_timer(timer);
+        timer->expires = expires;
+        link_timer(timer);
     }
-    return 1;
+    pthread_mutex_unlock(&timer_wheel.mutex);
 }
 
 /**
- * Sends a file to the specificed socket client or sends an error response
- * if the file was not found or any error ocurred, finally closes the
- * socket connection.
+ * Cancels the given timer, once this function returns the timer will not
+ * expire anymore and the socket it refers to can be safely closed.
  *
- * @param socket_descriptor an open socket descriptor
- * @param file_path the path of the file to be sent
- * @param mime_type the mime of the file to be sent
+ * @param timer a pointer to a <B>Timer</B>
  */
-void send_file(int socket_descriptor, char * file_path, HttpMimeType * mime_type) {
-    // Handle binary file sending
-    if(mime_type->binary) {
-
-        int file_descriptor = open(file_path, O_RDONLY);
-
-        if(file_descriptor > 0) {
-            send_http_header(socket_descriptor, 200, mime_type);
-
-            char buffer[BUFFER_SIZE];
-            int bytes;
-
-            // Write the binary file in chunks (using BUFFER_SIZE as the size of the chunk)
-            while ((bytes = read(file_descriptor, buffer, BUFFER_SIZE)) > 0) {
-                write(socket_descriptor, buffer, bytes);
-            }
-
-            close(file_descriptor);
-            close(socket_descriptor);
-        } else {
-            send_http_header(socket_descriptor, 404, NULL);
-        }
+void cancel_timer(Timer * timer) {
+    pthread_mutex_lock(&timer_wheel.mutex);
+    unlink_timer(timer);
+    pthread_mutex_unlock(&timer_wheel.mutex);
+}
 
+/**
+ * Advances the wheel by one tick, moving the timers of the higher levels
+ * whose range has been reached down to the lower levels, and expiring all
+ * the timers in the current slot of the lowest level.
+ *
+ * The wheel mutex must be held by the caller.
+ */
+void advance_timer_wheel() {
+    timer_wheel.current++;
+
+    // A level has to be cascaded when all the levels below it wrapped around
+    int levels = 1;
+    while(levels < TIMER_WHEEL_LEVELS
+          && ((timer_wheel.current >> ((levels - 1) * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK) == 0) {
+        levels++;
     }
-    // Handle text file sending
-    else {
-
-        FILE * file = fopen(file_path, "r");
-
-        if(file != NULL) {
-            send_http_header(socket_descriptor, 200, mime_type);
-
-            fseek(file, 0, SEEK_END);
-            long bytes_size = ftell(file);
-            fseek(file, 0, SEEK_SET);
-
-            char * buffer = malloc(bytes_size * sizeof(char));
-
-            // Read the html file straight to the buffer
-            fread(buffer, bytes_size, 1, file);
-
-            // Transmit the buffer directly to the client
-            write(socket_descriptor, buffer, bytes_size);
-            free(buffer);
-
-            fclose(file);
-            close(socket_descriptor);
-        } else {
-            send_http_header(socket_descriptor, 404, NULL);
+    for(int level = levels - 1; level > 0; level--) {
+        int slot = (timer_wheel.current >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+        Timer * timer = timer_wheel.slots[level][slot];
+        timer_wheel.slots[level][slot] = NULL;
+        while(timer != NULL) {
+            Timer * next = timer->next;
+            timer->link = NULL;
+            link_timer(timer);
+            timer = next;
         }
+    }
 
+    int slot = timer_wheel.current & TIMER_WHEEL_MASK;
+    Timer * timer = timer_wheel.slots[0][slot];
+    timer_wheel.slots[0][slot] = NULL;
+    while(timer != NULL) {
+        Timer * next = timer->next;
+        timer->next = NULL;
+        timer->link = NULL;
+        timer->expired = true;
+        shutdown(timer->socket_descriptor, SHUT_RDWR);
+        timer = next;
     }
 }
 
 /**
- * Handles the client request and sends a response.
+ * Drives the timer wheel, advancing it as many ticks as have elapsed since
+ * the last time it was advanced, and then sleeping until the next tick.
  *
- * @param socket an open socket to whom send a response.
+ * @param argument unused
  *
  * @return a pointer to this method
  */
-void * handle_request(void * socket) {
-
-    // Get the socket descriptor.
-    int socket_descriptor = * ((int *)socket);
-
-    sem_wait(&lock);
-
-    // If we run out of available connections reject connection
-    if(current_connections + 1 > MAX_CONNECTIONS) {
-        send_http_header(socket_descriptor, 503, NULL);
-        sem_post(&lock);
-        free(socket);
-        shutdown(socket_descriptor, SHUT_RDWR);
-        close(socket_descriptor);
-        socket_descriptor = -1;
-        pthread_exit(NULL);
-    } else {
-        current_connections++;
+void * run_timer_wheel(void * argument) {
+    (void) argument;
+    struct timespec tick = { 0, TIMER_TICK_MS * 1000000L };
+    while(true) {
+        nanosleep(&tick, NULL);
+        uint64_t now = monotonic_milliseconds() / TIMER_TICK_MS;
+        pthread_mutex_lock(&timer_wheel.mutex);
+        while(timer_wheel.current < now) {
+            advance_timer_wheel();
+        }
+        pthread_mutex_unlock(&timer_wheel.mutex);
     }
+    return NULL;
+}
 
-    sem_post(&lock);
-
-    char client_message[BUFFER_SIZE];
+/**
+ * Reads the CPU timestamp counter (or the monotonic clock in nanoseconds on
+ * architectures without one), cheap enough to be read at every stage of
+ * every request.
+ *
+ * @return the current timestamp in ticks
+ */
+uint64_t read_timestamp_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
 
-    // Read the entire client message to the buffer
-    int request = recv(socket_descriptor, client_message, BUFFER_SIZE, 0);
+/**
+ * Records the current timestamp for the given stage of the request being
+ * handled on the given connection.
+ *
+ * @param connection the connection handling the request
+ * @param stage the stage that was just reached (one of the TRACE_ constants)
+ */
+void trace_stage(HttpConnection * connection, int stage) {
+    connection->trace_stages[stage] = read_timestamp_counter();
+    TRACE_PROBE(connection->trace_id, stage);
+}
 
-    if(request < 0) {
-        printf("[Server] Client message reception failed\n");
-    }
-    else if (request == 0) {
-        printf("[Server] Client disconnected unexpectedly and closed the connection\n");
+/**
+ * Allocates one trace ring buffer per CPU and measures the frequency of the
+ * timestamp counter, so dumped traces can be converted to real time.
+ *
+ * @return 0 if tracing was set up and 1 otherwise.
+ */
+int create_trace_rings() {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    trace_ring_count = cpus > 0 ? cpus : 1;
+    trace_rings = calloc(trace_ring_count, sizeof(HttpTraceRing));
+    if(trace_rings == NULL) {
+        fprintf(stderr, "Failed to allocate memory for trace buffers: %s\n", strerror(errno));
+        fflush(stderr);
+        return 1;
     }
-    else {
-        int parse_status;
-        HttpRequest * http_request = parse_http_request(client_message, &parse_status);
-
-        // Printing status to the console
-        printf("\n");
-        printf("1. Parse parse_status: %d\n", parse_status);
-        if(parse_status == 0) {
-            printf("2. Request method: %s\n", http_request->method);
-            printf("3. URI: %s\n", http_request->uri);
-            printf("4. Http Version: %s\n", http_request->version);
-            printf("5. Http Headers:\n");
-            HttpHeader * header = http_request->headers;
-            while(header != NULL) {
-                printf("   - %s : %s\n", header->name, header->value);
-                header = header->next;
-            }
-            printf("6. Body: %s\n", http_request->body);
-
+    for(int i = 0; i < trace_ring_count; i++) {
+        trace_rings[i].records = calloc(configuration.trace_buffer_records, sizeof(HttpTraceRecord));
+        if(trace_rings[i].records == NULL) {
+            fprintf(stderr, "Failed to allocate memory for trace buffers: %s\n", strerror(errno));
+            fflush(stderr);
+            return 1;
         }
-        printf("\n");
-        fflush(stdout);
-        // END
-
-        // If the parsing was successful
-        if(parse_status == 0) {
-
-            // Concat the requested file path with the public resources folder
-            char * file_path = malloc((strlen(PUBLIC_FOLDER) + strlen(http_request->uri)) * sizeof(char));
-            strcpy(file_path, PUBLIC_FOLDER);
-            strcat(file_path, http_request->uri);
-
-            // Extract the extension of the requested file
-            char * to_tokenize = strdup(http_request->uri);
-            strtok(to_tokenize, ".");
-            char * extension = strtok(NULL, ".");
-
-            // Extract the MIME information using the extracted file extension
-            HttpMimeType * mime_type = from_extension_mime_type(extension);
-            if(mime_type != NULL) {
-                sem_wait(&lock);
-                // Send the file to the client or an error response if file was not found
-                send_file(socket_descriptor, file_path, mime_type);
-                sem_post(&lock);
-            } else {
-                send_http_header(socket_descriptor, 400, NULL);
-            }
+        pthread_mutex_init(&trace_rings[i].mutex, NULL);
+    }
 
-            // Free allocated resources
-            free(file_path);
-            free(to_tokenize);
-            free_http_mime_type(mime_type);
-            free(http_request);
+    struct timespec pause = { 0, 20000000L };
+    uint64_t start_ticks = read_timestamp_counter();
+    uint64_t start = monotonic_milliseconds();
+    nanosleep(&pause, NULL);
+    uint64_t elapsed = monotonic_milliseconds() - start;
+    trace_ticks_per_microsecond = (double) (read_timestamp_counter() - start_ticks) / (elapsed > 0 ? elapsed * 1000 : 1);
+    return 0;
+}
 
-        } else {
-            send_http_header(socket_descriptor, 400, NULL);
-        }
+/**
+ * Finishes the trace of the request handled on the given connection, storing
+ * it in the ring buffer of the current CPU if it was sampled or if it was
+ * slower than the slow request threshold. Once a ring is full the oldest
+ * records are overwritten.
+ *
+ * @param connection the connection that handled the request
+ */
+void finish_trace(HttpConnection * connection) {
+    if(trace_rings == NULL || connection->trace_stages[TRACE_ACCEPT] == 0) return;
 
+    uint64_t last = connection->trace_stages[TRACE_ACCEPT];
+    for(int stage = 0; stage < TRACE_STAGE_COUNT; stage++) {
+        if(connection->trace_stages[stage] > last) last = connection->trace_stages[stage];
     }
-
-    // Close connection and finish thread
-    fflush(stdout);
-    free(socket);
-    shutdown(socket_descriptor, SHUT_RDWR);
-    close(socket_descriptor);
-    socket_descriptor = -1;
-    sem_wait(&lock);
-    current_connections--;
-    sem_post(&lock);
-    pthread_exit(NULL);
+    double duration = (last - connection->trace_stages[TRACE_ACCEPT]) / trace_ticks_per_microsecond;
+
+    bool sampled = configuration.trace_sample_rate > 0 && connection->trace_id % configuration.trace_sample_rate == 0;
+    bool slow = configuration.trace_slow_ms > 0 && duration >= configuration.trace_slow_ms * 1000.0;
+    if(!sampled && !slow) return;
+
+    int cpu = sched_getcpu();
+    HttpTraceRing * ring = &trace_rings[(cpu >= 0 ? cpu : 0) % trace_ring_count];
+    pthread_mutex_lock(&ring->mutex);
+    HttpTraceRecord * record = &ring->records[ring->head % configuration.trace_buffer_records];
+    record->id = connection->trace_id;
+    record->thread = syscall(SYS_gettid);
+    record->status_code = connection->status_code;
+    record->slow = slow;
+    memcpy(record->stages, connection->trace_stages, sizeof(record->stages));
+    ring->head++;
+    pthread_mutex_unlock(&ring->mutex);
 }
 
-int main(int argc, char *argv[]) {
-
-    sem_init(&lock, 0, 1);
+/**
+ * Writes the contents of all the trace ring buffers to the configured trace
+ * file: a <B>HttpTraceHeader</B> followed by the records.
+ *
+ * @return 0 if the traces were written and 1 otherwise.
+ */
+int dump_traces() {
+    if(trace_rings == NULL) return 1;
 
-    int socket_descriptor = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_descriptor == -1) {
-        printf("[Server] Could not create the socket\n");
+    FILE * file = fopen(configuration.trace_file, "wb");
+    if(file == NULL) {
+        printf("[Server] Could not open the trace file %s\n", configuration.trace_file);
         fflush(stdout);
         return 1;
     }
 
-    struct sockaddr_in server;
-    struct sockaddr_in client;
+    HttpTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.stage_count = TRACE_STAGE_COUNT;
+    header.ticks_per_microsecond = trace_ticks_per_microsecond;
+    fwrite(&header, sizeof(header), 1, file);
+
+    uint64_t count = 0;
+    for(int i = 0; i < trace_ring_count; i++) {
+        HttpTraceRing * ring = &trace_rings[i];
+        pthread_mutex_lock(&ring->mutex);
+        uint64_t stored = ring->head < (uint64_t) configuration.trace_buffer_records ? ring->head : (uint64_t) configuration.trace_buffer_records;
+        fwrite(ring->records, sizeof(HttpTraceRecord), stored, file);
+        pthread_mutex_unlock(&ring->mutex);
+        count += stored;
+    }
 
-    // Set socket to TCP, assign ADDRESS and set PORT number
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(PORT_NUMBER);
+    // The record count is known once all the rings were written
+    header.record_count = count;
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    fclose(file);
 
-    // Assign address to server socket
-    if (bind(socket_descriptor, (struct sockaddr *) &server, sizeof(server)) < 0) {
-        printf("[Server] Binding has failed\n");
-        fflush(stdout);
+    printf("[Server] Dumped %lu request traces to %s\n", (unsigned long) count, configuration.trace_file);
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Converts a trace file written by <B>dump_traces</B> to the Chrome trace
+ * event format (also loaded by Perfetto), printing it to the standard output.
+ * Every request becomes one event, with one nested event per stage lasting
+ * from the previous recorded stage.
+ *
+ * @param path the path of the trace file
+ *
+ * @return 0 if the file was converted and 1 otherwise.
+ */
+int convert_trace_to_json(const char * path) {
+    static const char * STAGE_NAMES[TRACE_STAGE_COUNT] = {
+        "accept", "first byte received", "parse done", "MIME resolved",
+        "disk lock acquired", "file opened", "headers sent", "last byte sent"
+    };
+
+    FILE * file = fopen(path, "rb");
+    HttpTraceHeader header;
+    if(file == NULL || fread(&header, sizeof(header), 1, file) != 1
+       || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.stage_count != TRACE_STAGE_COUNT) {
+        fprintf(stderr, "Invalid trace file: %s\n", path);
+        fflush(stderr);
+        if(file != NULL) fclose(file);
         return 1;
     }
-    listen(socket_descriptor, MAX_CONNECTIONS);
-
-    printf("[Server] Waiting for incoming connections...\n");
-    fflush(stdout);
 
-    int address_length = sizeof(struct sockaddr_in);
-    int new_socket;
-    while ((new_socket = accept(socket_descriptor, (struct sockaddr *)&client, (socklen_t *)&address_length))) {
-        printf("[Server] New connection accepted!\n");
-        fflush(stdout);
+    HttpTraceRecord * records = malloc(header.record_count * sizeof(HttpTraceRecord) + 1);
+    if(records == NULL || fread(records, sizeof(HttpTraceRecord), header.record_count, file) != header.record_count) {
+        fprintf(stderr, "Invalid trace file: %s\n", path);
+        fflush(stderr);
+        free(records);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
 
-        int * job_socket = malloc(1);
-        * job_socket = new_socket;
+    // Timestamps are printed in microseconds since the earliest accepted request
+    uint64_t base = UINT64_MAX;
+    for(uint64_t i = 0; i < header.record_count; i++) {
+        if(records[i].stages[TRACE_ACCEPT] < base) base = records[i].stages[TRACE_ACCEPT];
+    }
 
-        // Creating a new thread that will handle each request
-        pthread_t job_thread;
-        int result = pthread_create(&job_thread, NULL, handle_request, (void *) job_socket);
-        if (result < 0) {
-            printf("[Server] Could not create a new thread!\n");
-            fflush(stdout);
-            return 1;
+    printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    bool first = true;
+    for(uint64_t i = 0; i < header.record_count; i++) {
+        HttpTraceRecord * record = &records[i];
+        uint64_t previous = record->stages[TRACE_ACCEPT];
+        uint64_t last = previous;
+        for(int stage = 1; stage < TRACE_STAGE_COUNT; stage++) {
+            if(record->stages[stage] < previous) continue;
+            printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                   first ? "" : ",", STAGE_NAMES[stage], record->thread,
+                   (previous - base) / header.ticks_per_microsecond,
+                   (record->stages[stage] - previous) / header.ticks_per_microsecond);
+            first = false;
+            previous = record->stages[stage];
+            last = previous;
         }
+        printf("%s{\"name\":\"request %lu\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+               "\"args\":{\"status\":%u,\"slow\":%s}}",
+               first ? "" : ",", (unsigned long) record->id, record->thread,
+               (record->stages[TRACE_ACCEPT] - base) / header.ticks_per_microsecond,
+               (last - record->stages[TRACE_ACCEPT]) / header.ticks_per_microsecond,
+               record->status_code, record->slow ? "true" : "false");
+        first = false;
     }
+    printf("]}\n");
 
+    free(records);
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Returns a pointer to a new allocated <B>HttpConnection</B> structure for
+ * the given socket, with its timer disarmed.
+ *
+ * The returned structure should be freed by the client.
+ *
+ * @param socket_descriptor the descriptor of an accepted socket
+ *
+ * @return a pointer to a new allocated <B>HttpConnection</B> structure, or
+ *         <I>NULL</I> if there is no enough space for allocation
+ */
+HttpConnection * create_http_connection(int socket_descriptor) {
+    HttpConnection * connection = malloc(sizeof(HttpConnection));
+    if(connection == NULL) {
+        fprintf(stderr, "Failed to allocate memory for http connection: %s\n", strerror(errno));
+        fflush(stderr);
+        return NULL;
+    }
+    __atomic_fetch_add(&open_connections, 1, __ATOMIC_RELAXED);
+    connection->socket_descriptor = socket_descriptor;
+    connection->has_client_address = false;
+    connection->timer.expires = 0;
+    connection->timer.socket_descriptor = socket_descriptor;
+    connection->timer.deadline = NULL;
+    connection->timer.expired = false;
+    connection->timer.next = NULL;
+    connection->timer.link = NULL;
+    connection->send_started = 0;
+    connection->send_paused = 0;
+    connection->bytes_sent = 0;
+    connection->trace_id = __atomic_add_fetch(&trace_sequence, 1, __ATOMIC_RELAXED);
+    memset(connection->trace_stages, 0, sizeof(connection->trace_stages));
+    connection->status_code = 0;
+    trace_stage(connection, TRACE_ACCEPT);
+#ifdef ENABLE_TLS
+    connection->tls = NULL;
+    connection->ktls_send = false;
+    connection->ktls_receive = false;
+#endif
+    return connection;
+}
+
+/**
+ * Cancels the timer of the given <B>HttpConnection</B>, ends its TLS session,
+ * closes its socket and frees the structure. If the given connection is <I>NULL</I> nothing
+ * is done.
+ *
+ * @param connection a pointer to a <B>HttpConnection</B>
+ */
+void free_http_connection(HttpConnection * connection) {
+    if(connection == NULL) return;
+    // The timer must be cancelled before closing, otherwise it could shut down a reused descriptor
+    cancel_timer(&connection->timer);
+#ifdef ENABLE_TLS
+    if(connection->tls != NULL) {
+        // Send the close notify without blocking, a client that stopped reading will not get it
+        fcntl(connection->socket_descriptor, F_SETFL, fcntl(connection->socket_descriptor, F_GETFL) | O_NONBLOCK);
+        SSL_shutdown(connection->tls);
+        SSL_free(connection->tls);
+    }
+#endif
+    shutdown(connection->socket_descriptor, SHUT_RDWR);
+    close(connection->socket_descriptor);
+    free(connection);
+    __atomic_fetch_sub(&open_connections, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Checks an I/O buffer of <B>buffer_size</B> bytes out of the shared pool,
+ * allocating a new one if there is no idle buffer. The data always has room
+ * for one more byte, so a full buffer can still be null terminated.
+ *
+ * The returned buffer should be given back with <B>release_buffers</B>.
+ *
+ * @return a pointer to an empty <B>HttpBuffer</B>, or <I>NULL</I> if there
+ *         is no enough space for allocation
+ */
+HttpBuffer * acquire_buffer() {
+    pthread_mutex_lock(&buffer_pool.mutex);
+    HttpBuffer * buffer = buffer_pool.idle;
+    if(buffer != NULL) {
+        buffer_pool.idle = buffer->next;
+        buffer_pool.idle_count--;
+    } else {
+        buffer = malloc(sizeof(HttpBuffer) + configuration.buffer_size + 1);
+        if(buffer == NULL) {
+            pthread_mutex_unlock(&buffer_pool.mutex);
+            fprintf(stderr, "Failed to allocate memory for I/O buffer: %s\n", strerror(errno));
+            fflush(stderr);
+            return NULL;
+        }
+        buffer->capacity = configuration.buffer_size;
+        buffer_pool.allocated++;
+    }
+    buffer_pool.in_use++;
+    if(buffer_pool.in_use > buffer_pool.peak_in_use) buffer_pool.peak_in_use = buffer_pool.in_use;
+    pthread_mutex_unlock(&buffer_pool.mutex);
+
+    buffer->next = NULL;
+    buffer->length = 0;
+    return buffer;
+}
+
+/**
+ * Gives back all the buffers of the given chain. Pooled buffers are kept for
+ * reuse while the pool has room for them, the rest are freed.
+ *
+ * @param buffer the first buffer of the chain (can be <I>NULL</I>)
+ */
+void release_buffers(HttpBuffer * buffer) {
+    while(buffer != NULL) {
+        HttpBuffer * next = buffer->next;
+        pthread_mutex_lock(&buffer_pool.mutex);
+        bool pooled = buffer->capacity == configuration.buffer_size;
+        if(pooled) buffer_pool.in_use--;
+        if(pooled && buffer_pool.idle_count < BUFFER_POOL_SIZE) {
+            buffer->next = buffer_pool.idle;
+            buffer_pool.idle = buffer;
+            buffer_pool.idle_count++;
+        } else {
+            if(pooled) buffer_pool.allocated--;
+            free(buffer);
+        }
+        pthread_mutex_unlock(&buffer_pool.mutex);
+        buffer = next;
+    }
+}
+
+/**
+ * Returns the contents of the given chain in a single buffer. A chain of one
+ * buffer is returned as is, otherwise the contents are copied to a new
+ * buffer (not taken from the pool) and the chain is released.
+ *
+ * @param chain the first buffer of the chain
+ *
+ * @return the buffer with the whole contents, or <I>NULL</I> if there is no
+ *         enough space for allocation (the chain is released anyway)
+ */
+HttpBuffer * join_buffers(HttpBuffer * chain) {
+    if(chain == NULL || chain->next == NULL) return chain;
+
+    int length = 0;
+    for(HttpBuffer * buffer = chain; buffer != NULL; buffer = buffer->next) {
+        length += buffer->length;
+    }
+    HttpBuffer * joined = malloc(sizeof(HttpBuffer) + length + 1);
+    if(joined != NULL) {
+        joined->next = NULL;
+        joined->length = 0;
+        joined->capacity = length;
+        for(HttpBuffer * buffer = chain; buffer != NULL; buffer = buffer->next) {
+            memcpy(joined->data + joined->length, buffer->data, buffer->length);
+            joined->length += buffer->length;
+        }
+        joined->data[joined->length] = '\0';
+    }
+    release_buffers(chain);
+    return joined;
+}
+
+/**
+ * Prints how much memory the I/O buffers take, in total and per open
+ * connection, along with the highest number of buffers ever in use.
+ */
+void print_buffer_statistics() {
+    pthread_mutex_lock(&buffer_pool.mutex);
+    int allocated = buffer_pool.allocated;
+    int in_use = buffer_pool.in_use;
+    int peak_in_use = buffer_pool.peak_in_use;
+    int idle_count = buffer_pool.idle_count;
+    pthread_mutex_unlock(&buffer_pool.mutex);
+
+    int connections = __atomic_load_n(&open_connections, __ATOMIC_RELAXED);
+    long bytes = (long) allocated * (sizeof(HttpBuffer) + configuration.buffer_size + 1);
+    printf("[Server] I/O buffers: %d in use (peak %d), %d idle, %ld bytes for %d open connections (%ld bytes per connection)\n",
+           in_use, peak_in_use, idle_count, bytes, connections, connections > 0 ? bytes / connections : bytes);
+    fflush(stdout);
+}
+
+/**
+ * Receives up to the given number of bytes from the connection, decrypting
+ * them first if it is a TLS connection.
+ *
+ * @param connection the connection to receive the data from
+ * @param buffer the buffer where the data is stored
+ * @param length the size of the buffer
+ *
+ * @return the number of bytes received, 0 if the client closed the connection,
+ *         or -1 if the reception failed
+ */
+ssize_t connection_receive(HttpConnection * connection, void * buffer, size_t length) {
+#ifdef ENABLE_TLS
+    if(connection->tls != NULL) {
+        int bytes = SSL_read(connection->tls, buffer, length);
+        if(bytes > 0) return bytes;
+        int error = SSL_get_error(connection->tls, bytes);
+        if(error == SSL_ERROR_ZERO_RETURN) return 0;
+        if(error != SSL_ERROR_SYSCALL) errno = EIO;
+        return -1;
+    }
+#endif
+    return recv(connection->socket_descriptor, buffer, length, 0);
+}
+
+/**
+ * Sends up to the given number of bytes to the connection, encrypting them
+ * first if it is a TLS connection.
+ *
+ * @param connection the connection to send the data to
+ * @param data the bytes to be sent
+ * @param length the number of bytes to be sent
+ *
+ * @return the number of bytes sent, or -1 if the sending failed
+ */
+ssize_t connection_send(HttpConnection * connection, const void * data, size_t length) {
+#ifdef ENABLE_TLS
+    if(connection->tls != NULL) {
+        int bytes = SSL_write(connection->tls, data, length);
+        if(bytes > 0) return bytes;
+        if(SSL_get_error(connection->tls, bytes) != SSL_ERROR_SYSCALL) errno = EIO;
+        return -1;
+    }
+#endif
+    return send(connection->socket_descriptor, data, length, MSG_NOSIGNAL);
+}
+
+/**
+ * Checks whether bytes can be moved to or from the connection socket directly
+ * by the kernel (with sendfile or splice). That is always the case for
+ * plaintext connections, and for TLS connections only when kernel TLS took
+ * over the given direction and OpenSSL has no decrypted bytes pending.
+ *
+ * @param connection the connection
+ * @param sending true to check sending to the connection, false to check receiving
+ *
+ * @return true if the socket can be used directly, false otherwise
+ */
+bool connection_is_zero_copy(HttpConnection * connection, bool sending) {
+#ifdef ENABLE_TLS
+    if(connection->tls != NULL) {
+        return sending ? connection->ktls_send : connection->ktls_receive && SSL_pending(connection->tls) == 0;
+    }
+#endif
+    (void) connection;
+    (void) sending;
+    return true;
+}
+
+/**
+ * Arms the send deadline of the given connection after the given number of
+ * bytes has been sent to it (pass 0 before the first write). The deadline
+ * allows one grace period of stalling plus the time needed to send all the
+ * bytes so far at the minimum send rate. Time spent paused between writes
+ * (see <B>pause_send_timer</B>) does not count.
+ *
+ * @param connection the connection being written to
+ * @param bytes the number of bytes just sent
+ */
+void arm_send_timer(HttpConnection * connection, size_t bytes) {
+    uint64_t now = monotonic_milliseconds();
+    if(connection->send_started == 0) connection->send_started = now;
+    if(connection->send_paused != 0) {
+        connection->send_started += now - connection->send_paused;
+        connection->send_paused = 0;
+    }
+    connection->bytes_sent += bytes;
+    // The deadline moves forward as long as the client keeps reading at the minimum rate,
+    // but a client that stops reading entirely never gets more than one grace period
+    uint64_t stall_deadline = now + SEND_TIMEOUT_MS;
+    uint64_t rate_deadline = connection->send_started + SEND_TIMEOUT_MS + connection->bytes_sent * 1000 / MIN_SEND_RATE;
+    arm_timer(&connection->timer, stall_deadline < rate_deadline ? stall_deadline : rate_deadline, "send");
+}
+
+/**
+ * Cancels the send deadline of the given connection once a write finished,
+ * while the connection waits for more data to send (like a slow upstream,
+ * which is watched by its own deadline). The client is only held to the
+ * minimum send rate for the time it actually takes to write to it.
+ *
+ * @param connection the connection that was written to
+ */
+void pause_send_timer(HttpConnection * connection) {
+    cancel_timer(&connection->timer);
+    connection->send_paused = monotonic_milliseconds();
+}
+
+/**
+ * Sends all the given bytes to the connection socket, retrying on short
+ * writes. While sending the connection timer enforces the minimum send rate,
+ * so a client that does not read the response gets disconnected.
+ *
+ * @param connection the connection to send the data to
+ * @param data the bytes to be sent
+ * @param length the number of bytes to be sent
+ *
+ * @return 0 if all the bytes were sent and 1 otherwise.
+ */
+int send_all(HttpConnection * connection, const char * data, size_t length) {
+    arm_send_timer(connection, 0);
+    while(length > 0) {
+        ssize_t bytes = connection_send(connection, data, length);
+        if(bytes < 0 && errno == EINTR) continue;
+        if(bytes <= 0) return 1;
+        data += bytes;
+        length -= bytes;
+        arm_send_timer(connection, bytes);
+    }
+    pause_send_timer(connection);
+    return 0;
+}
+
+/**
+ * Returns a pointer to the value of the first header with the given name
+ * (compared case insensitively) of the given message, looking for it only
+ * before the given end of the headers. The value is not null terminated,
+ * it ends at the next "\r\n".
+ *
+ * @param message a received http message
+ * @param headers_end a pointer to the "\r\n\r\n" ending the headers in the message
+ * @param name the name of the header
+ *
+ * @return a pointer to the value of the header, or <I>NULL</I> if it is not present
+ */
+char * find_header_value(char * message, char * headers_end, const char * name) {
+    size_t length = strlen(name);
+    char * line = strstr(message, "\r\n");
+    while(line != NULL && line < headers_end) {
+        line += 2;
+        if(strncasecmp(line, name, length) == 0 && line[length] == ':') {
+            char * value = line + length + 1;
+            while((* value) == ' ' || (* value) == '\t') value++;
+            return value;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+/**
+ * Checks whether the value of the given header contains the given token
+ * (compared case insensitively), like "close" in "Connection: close".
+ *
+ * @param message a received http message
+ * @param headers_end a pointer to the "\r\n\r\n" ending the headers in the message
+ * @param name the name of the header
+ * @param token the token to look for
+ *
+ * @return true if the header is present and contains the token, false otherwise
+ */
+bool header_has_token(char * message, char * headers_end, const char * name, const char * token) {
+    char * value = find_header_value(message, headers_end, name);
+    if(value == NULL) return false;
+    size_t length = strlen(token);
+    char * end = strstr(value, "\r\n");
+    for(char * traversal = value; traversal + length <= end; traversal++) {
+        if(strncasecmp(traversal, token, length) == 0) return true;
+    }
+    return false;
+}
+
+/**
+ * Returns the value of the Content-Length header of the given message,
+ * looking for it only before the given end of the headers.
+ *
+ * @param message a received http message
+ * @param headers_end a pointer to the "\r\n\r\n" ending the headers in the message
+ *
+ * @return the declared body length, 0 if it is invalid, or -1 if it is not present
+ */
+long parse_content_length(char * message, char * headers_end) {
+    char * value = find_header_value(message, headers_end, "Content-Length");
+    if(value == NULL) return -1;
+    long length = strtol(value, NULL, 10);
+    return length > 0 ? length : 0;
+}
+
+/**
+ * Waits until the connection has bytes to be received, or it was closed or
+ * its deadline expired, so no buffer is held while the client is idle.
+ *
+ * @param connection the connection to wait for
+ */
+void wait_for_data(HttpConnection * connection) {
+#ifdef ENABLE_TLS
+    if(connection->tls != NULL && SSL_pending(connection->tls) > 0) return;
+#endif
+    struct pollfd ready = { connection->socket_descriptor, POLLIN, 0 };
+    while(poll(&ready, 1, -1) < 0 && errno == EINTR);
+}
+
+/**
+ * Receives a complete http message (headers and the body declared in its
+ * Content-Length) into buffers checked out of the pool once the client
+ * starts sending. Headers that do not fit in a buffer are received into a
+ * chain of up to <B>MAX_MESSAGE_BUFFERS</B> buffers, which is then joined so
+ * the message is always contiguous and null terminated. The idle, header and
+ * body deadlines are enforced while receiving.
+ *
+ * If the message does not fit before it is complete, the received part is
+ * returned as is.
+ *
+ * The returned message should be given back with <B>release_buffers</B>.
+ *
+ * @param connection the connection to receive the message from
+ * @param message where the buffer holding the message is stored (<I>NULL</I>
+ *        if nothing was received)
+ *
+ * @return the number of bytes received, 0 if the client disconnected before
+ *         sending anything, or -1 if the reception failed or timed out
+ */
+int receive_http_message(HttpConnection * connection, HttpBuffer ** message) {
+    HttpBuffer * last = NULL;
+    int buffer_count = 0;
+    int received = 0;
+    long expected = -1;
+    // Bytes of the "\r\n\r\n" that ends the headers matched so far (it can span two buffers)
+    int matched = 0;
+    (* message) = NULL;
+    arm_timer(&connection->timer, monotonic_milliseconds() + IDLE_TIMEOUT_MS, "idle");
+    wait_for_data(connection);
+
+    while(true) {
+        if(last == NULL || last->length == last->capacity) {
+            // Only the headers grow the message, the rest of a body that does not fit stays in the socket
+            if(expected >= 0 || buffer_count == MAX_MESSAGE_BUFFERS) break;
+            HttpBuffer * buffer = acquire_buffer();
+            if(buffer == NULL) {
+                release_buffers(* message);
+                (* message) = NULL;
+                return -1;
+            }
+            if(last == NULL) (* message) = buffer;
+            else last->next = buffer;
+            last = buffer;
+            buffer_count++;
+        }
+
+        int bytes = connection_receive(connection, last->data + last->length, last->capacity - last->length);
+        if(bytes < 0 && errno == EINTR) continue;
+        if(bytes <= 0) {
+            release_buffers(* message);
+            (* message) = NULL;
+            // Timed out, failed, or the client closed the connection in the middle of a message
+            if(connection->timer.expired || bytes < 0 || received > 0) return -1;
+            return 0;
+        }
+
+        if(received == 0) {
+            trace_stage(connection, TRACE_FIRST_BYTE);
+            arm_timer(&connection->timer, monotonic_milliseconds() + HEADER_TIMEOUT_MS, "header");
+        }
+
+        long headers_length = -1;
+        for(int i = last->length; expected < 0 && i < last->length + bytes; i++) {
+            matched = last->data[i] == "\r\n\r\n"[matched] ? matched + 1 : (last->data[i] == '\r' ? 1 : 0);
+            if(matched == 4) {
+                headers_length = received + (i - last->length) + 1;
+                break;
+            }
+        }
+        last->length += bytes;
+        last->data[last->length] = '\0';
+        received += bytes;
+
+        if(headers_length >= 0) {
+            // The headers are parsed from a single buffer
+            (* message) = join_buffers(* message);
+            last = (* message);
+            if(last == NULL) return -1;
+            long content_length = parse_content_length(last->data, last->data + headers_length - 4);
+            expected = headers_length + (content_length > 0 ? content_length : 0);
+            if(expected > received) {
+                arm_timer(&connection->timer, monotonic_milliseconds() + BODY_TIMEOUT_MS, "body");
+            }
+        }
+        if(expected >= 0 && received >= expected) break;
+    }
+
+    (* message) = join_buffers(* message);
+    return (* message) != NULL ? received : -1;
+}
+
+/**
+ * Sends an http header response and status using the specificied connection.
+ * If the response does not involve sending a file pass <I>NULL</I> to the
+ * mime type.
+ *
+ * @param connection the connection to send the response to
+ * @param http_status_code an http status code
+ * @param mime_type a mime type that represents the content of a file to be sent
+ *
+ * @return 0 if the sending was successful and 1 otherwise.
+ */
+int send_http_header(HttpConnection * connection, int http_status_code, HttpMimeType * mime_type) {
+    connection->status_code = http_status_code;
+    if(http_status_code == 200) {
+
+        // I need a variadic function for concatenation or maybe a library
+        // for strings which I don't have right now, when I'll feel like
+        // wanting to suffer I'll code one, but for now we have this messy
+        // concatenation.
+
+        char * response = strdup("HTTP/1.1 200 OK\r\nContent-Type: ");
+        char * concat = concat_strings(response, mime_type->mime);
+        free(response);
+        response = concat_strings(concat, "\r\n\r\n");
+        free(concat);
+
+        int result = send_all(connection, response, strlen(response));
+        free(response);
+
+        return result;
+    } else if(http_status_code == 400) {
+        static const char response[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+        return send_all(connection, response, strlen(response));
+    } else if(http_status_code == 404) {
+        static const char response[] = "HTTP/1.1 404 Not Found\r\nConnection: close\r\n\r\n";
+        return send_all(connection, response, strlen(response));
+    } else if(http_status_code == 429) {
+        static const char response[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+        return send_all(connection, response, strlen(response));
+    } else if(http_status_code == 502) {
+        static const char response[] = "HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\n\r\n";
+        return send_all(connection, response, strlen(response));
+    } else if(http_status_code == 503) {
+        static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+        return send_all(connection, response, strlen(response));
+    } else if(http_status_code == 504) {
+        static const char response[] = "HTTP/1.1 504 Gateway Timeout\r\nConnection: close\r\n\r\n";
+        return send_all(connection, response, strlen(response));
+    }
+    return 1;
+}
+
+/**
+ * Sends the whole contents of the given open file to the connection. The
+ * kernel copies the file straight to the socket with sendfile whenever the
+ * connection allows it (plaintext or kernel TLS), otherwise the file is read
+ * in chunks and encrypted in user space.
+ *
+ * @param connection the connection to send the file to
+ * @param file_descriptor the descriptor of an open file
+ *
+ * @return 0 if the whole file was sent and 1 otherwise.
+ */
+int send_file_contents(HttpConnection * connection, int file_descriptor) {
+    if(!connection_is_zero_copy(connection, true)) {
+        HttpBuffer * buffer = acquire_buffer();
+        if(buffer == NULL) return 1;
+        int bytes;
+
+        // Write the file in chunks (using the buffer size as the size of the chunk)
+        while ((bytes = read(file_descriptor, buffer->data, buffer->capacity)) > 0) {
+            if(send_all(connection, buffer->data, bytes) != 0) break;
+        }
+        release_buffers(buffer);
+        return bytes != 0 ? 1 : 0;
+    }
+
+    struct stat file_status;
+    if(fstat(file_descriptor, &file_status) != 0) return 1;
+
+    off_t offset = 0;
+    arm_send_timer(connection, 0);
+    while(offset < file_status.st_size) {
+        size_t chunk = file_status.st_size - offset > SEND_FILE_CHUNK_SIZE ? SEND_FILE_CHUNK_SIZE : (size_t) (file_status.st_size - offset);
+        ssize_t bytes;
+#ifdef ENABLE_KTLS
+        if(connection->tls != NULL) {
+            bytes = SSL_sendfile(connection->tls, file_descriptor, offset, chunk, 0);
+            if(bytes > 0) offset += bytes;
+        } else
+#endif
+        bytes = sendfile(connection->socket_descriptor, file_descriptor, &offset, chunk);
+        if(bytes < 0 && errno == EINTR) continue;
+        // The file may have been truncated while sending it
+        if(bytes <= 0) return 1;
+        arm_send_timer(connection, bytes);
+    }
+    return 0;
+}
+
+/**
+ * Normalizes the path of the given uri in place: the query and fragment
+ * are stripped, percent-encoded bytes are decoded, and empty, "." and ".."
+ * segments are removed (".." never goes above the root). The resulting
+ * path always starts with '/' and keeps a trailing '/' of the original.
+ *
+ * @param uri the uri to be normalized
+ *
+ * @return 0 if the path was normalized and 1 if it is invalid
+ */
+int normalize_uri_path(char * uri) {
+    if(uri[0] != '/') return 1;
+    uri[strcspn(uri, "?#")] = '\0';
+
+    // ## 1. DECODING PERCENT-ENCODED BYTES ##
+
+    char * read = uri;
+    char * write = uri;
+    while((* read) != '\0') {
+        if((* read) != '%') {
+            (* write++) = (* read++);
+            continue;
+        }
+        if(!isxdigit((unsigned char) read[1]) || !isxdigit((unsigned char) read[2])) return 1;
+        int high = isdigit((unsigned char) read[1]) ? read[1] - '0' : tolower((unsigned char) read[1]) - 'a' + 10;
+        int low = isdigit((unsigned char) read[2]) ? read[2] - '0' : tolower((unsigned char) read[2]) - 'a' + 10;
+        // An encoded null byte would silently truncate the path
+        if(high == 0 && low == 0) return 1;
+        (* write++) = (char) (high * 16 + low);
+        read += 3;
+    }
+    (* write) = '\0';
+
+    // ## 2. REMOVING DOT SEGMENTS ##
+
+    // A path naming a directory still does after its dot segments are removed ("/a/b/.." is "/a/")
+    char * last_segment = strrchr(uri, '/') + 1;
+    bool is_directory = strcmp(last_segment, "") == 0 || strcmp(last_segment, ".") == 0
+                        || strcmp(last_segment, "..") == 0;
+    read = uri;
+    write = uri;
+    while((* read) != '\0') {
+        while((* read) == '/') read++;
+        char * segment = read;
+        while((* read) != '\0' && (* read) != '/') read++;
+        size_t length = read - segment;
+
+        if(length == 0 || (length == 1 && segment[0] == '.')) continue;
+        if(length == 2 && segment[0] == '.' && segment[1] == '.') {
+            // Drop the last written segment together with its '/'
+            while(write > uri && (* --write) != '/');
+            continue;
+        }
+        (* write++) = '/';
+        memmove(write, segment, length);
+        write += length;
+    }
+    if(write == uri || is_directory) (* write++) = '/';
+    (* write) = '\0';
+    return 0;
+}
+
+/**
+ * Opens the file at the given normalized path beneath the public folder one
+ * segment at a time, refusing symbolic links anywhere in the path, since
+ * without openat2 the kernel would follow them out of the public folder.
+ *
+ * @param path a path normalized with <B>normalize_uri_path</B>
+ *
+ * @return the descriptor of the open file, or -1 if it does not exist or
+ *         the path goes through a symbolic link
+ */
+int open_public_file_without_links(char * path) {
+    int directory_descriptor = public_folder_descriptor;
+    const char * segment = path + 1;
+    while(true) {
+        size_t length = strcspn(segment, "/");
+        char name[NAME_MAX + 1];
+        if(length == 0 || length > NAME_MAX) break;
+        memcpy(name, segment, length);
+        name[length] = '\0';
+
+        bool is_last = segment[length] == '\0';
+        int descriptor = openat(directory_descriptor, name,
+                                (is_last ? O_RDONLY : O_PATH | O_DIRECTORY) | O_NOFOLLOW | O_CLOEXEC);
+        if(directory_descriptor != public_folder_descriptor) close(directory_descriptor);
+        if(is_last || descriptor < 0) return descriptor;
+        directory_descriptor = descriptor;
+        segment += length + 1;
+    }
+    if(directory_descriptor != public_folder_descriptor) close(directory_descriptor);
+    return -1;
+}
+
+/**
+ * Opens the regular file at the given normalized path beneath the public
+ * folder. The kernel resolves the path relative to the public folder
+ * descriptor and refuses to leave it, even through symbolic links (kernels
+ * without openat2 refuse symbolic links altogether).
+ *
+ * @param path a path normalized with <B>normalize_uri_path</B>
+ *
+ * @return the descriptor of the open file, or -1 if it does not exist, is
+ *         not a regular file or is outside of the public folder
+ */
+int open_public_file(char * path) {
+    // Kernels older than 5.6 do not have openat2 (shared by all the handler threads)
+    static bool has_openat2 = true;
+    int file_descriptor = -1;
+
+    if(__atomic_load_n(&has_openat2, __ATOMIC_RELAXED)) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = O_RDONLY | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        file_descriptor = syscall(SYS_openat2, public_folder_descriptor, path + 1, &how, sizeof(how));
+        if(file_descriptor < 0 && errno == ENOSYS) __atomic_store_n(&has_openat2, false, __ATOMIC_RELAXED);
+    }
+    if(!__atomic_load_n(&has_openat2, __ATOMIC_RELAXED)) {
+        file_descriptor = open_public_file_without_links(path);
+    }
+
+    struct stat file_status;
+    if(file_descriptor >= 0 && (fstat(file_descriptor, &file_status) != 0 || !S_ISREG(file_status.st_mode))) {
+        close(file_descriptor);
+        return -1;
+    }
+    return file_descriptor;
+}
+
+/**
+ * Sends a file to the specificed connection or sends an error response
+ * if the file was not found. Sending stops as soon as the client stops
+ * accepting data or falls below the minimum send rate.
+ *
+ * @param connection the connection to send the file to
+ * @param file_path the normalized path of the file to be sent, relative to the public folder
+ * @param mime_type the mime of the file to be sent
+ */
+void send_file(HttpConnection * connection, char * file_path, HttpMimeType * mime_type) {
+    // Text and binary files are sent the same way, with sendfile whenever the connection allows it
+    int file_descriptor = open_public_file(file_path);
+
+    if(file_descriptor >= 0) {
+        trace_stage(connection, TRACE_FILE_OPENED);
+        if(send_http_header(connection, 200, mime_type) == 0) {
+            trace_stage(connection, TRACE_HEADERS_SENT);
+            send_file_contents(connection, file_descriptor);
+        }
+
+        close(file_descriptor);
+    } else {
+        send_http_header(connection, 404, NULL);
+    }
+}
+
+/**
+ * Prefetches the contents of the given open file into the page cache if it
+ * still fits in the warm-up budget. The file is read ahead in chunks and the
+ * deadline is checked between them; what was not read is given back to the
+ * budget.
+ *
+ * @param warm_up the warm-up state
+ * @param file_descriptor the descriptor of an open regular file
+ * @param size the size of the file
+ */
+void prefetch_file(HttpWarmUp * warm_up, int file_descriptor, int64_t size) {
+    if(__atomic_sub_fetch(&warm_up->budget, size, __ATOMIC_RELAXED) < 0) {
+        __atomic_add_fetch(&warm_up->budget, size, __ATOMIC_RELAXED);
+        return;
+    }
+    int64_t offset = 0;
+    while(offset < size && monotonic_milliseconds() < warm_up->deadline) {
+        int64_t length = size - offset < WARM_UP_CHUNK_SIZE ? size - offset : WARM_UP_CHUNK_SIZE;
+        // Some file systems do not implement readahead, the advice still gets the pages read
+        if(readahead(file_descriptor, offset, length) != 0) {
+            posix_fadvise(file_descriptor, offset, length, POSIX_FADV_WILLNEED);
+        }
+        offset += length;
+    }
+    if(offset < size) __atomic_add_fetch(&warm_up->budget, size - offset, __ATOMIC_RELAXED);
+    if(offset > 0) {
+        __atomic_add_fetch(&warm_up->files, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&warm_up->bytes, offset, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Compares two inode numbers, for sorting and searching them.
+ *
+ * @param first a pointer to the first inode number
+ * @param second a pointer to the second inode number
+ *
+ * @return a negative number, zero or a positive number if the first inode
+ *         number is lower, equal or greater than the second one
+ */
+int compare_inodes(const void * first, const void * second) {
+    uint64_t first_inode = * (const uint64_t *) first;
+    uint64_t second_inode = * (const uint64_t *) second;
+    return first_inode < second_inode ? -1 : first_inode > second_inode;
+}
+
+/**
+ * Prefetches the files listed in the warm-up manifest, in order, so the
+ * hottest ones get the budget first. Every line holds a request path,
+ * access log lines are accepted too (their first word starting with '/' is
+ * taken as the path). A file listed again, even under another path, is
+ * only prefetched the first time.
+ *
+ * @param warm_up the warm-up state
+ * @param path the path of the manifest
+ */
+void prefetch_manifest(HttpWarmUp * warm_up, const char * path) {
+    FILE * file = fopen(path, "r");
+    if(file == NULL) {
+        printf("[Server] Could not open the warm-up manifest %s\n", path);
+        fflush(stdout);
+        return;
+    }
+
+    char line[1024];
+    while(fgets(line, sizeof(line), file) != NULL && monotonic_milliseconds() < warm_up->deadline) {
+        char * uri = line;
+        while((* uri) != '\0' && ((* uri) != '/' || (uri != line && !isspace((unsigned char) uri[-1])))) uri++;
+        uri[strcspn(uri, " \t\r\n\"")] = '\0';
+        if((* uri) == '\0' || normalize_uri_path(uri) != 0) continue;
+
+        int file_descriptor = open_public_file(uri);
+        struct stat file_status;
+        if(file_descriptor >= 0 && fstat(file_descriptor, &file_status) == 0) {
+            // The inodes are kept sorted as they are inserted, access logs repeat the same paths all the time
+            uint64_t inode = file_status.st_ino;
+            int position = 0;
+            int end = warm_up->prefetched_count;
+            while(position < end) {
+                int middle = position + (end - position) / 2;
+                if(warm_up->prefetched[middle] < inode) position = middle + 1;
+                else end = middle;
+            }
+            bool is_repeated = position < warm_up->prefetched_count && warm_up->prefetched[position] == inode;
+            if(!is_repeated && warm_up->prefetched_count == warm_up->prefetched_capacity) {
+                int capacity = warm_up->prefetched_capacity * 2 + 64;
+                uint64_t * prefetched = realloc(warm_up->prefetched, capacity * sizeof(uint64_t));
+                if(prefetched != NULL) {
+                    warm_up->prefetched = prefetched;
+                    warm_up->prefetched_capacity = capacity;
+                }
+            }
+            if(!is_repeated && warm_up->prefetched_count < warm_up->prefetched_capacity) {
+                memmove(warm_up->prefetched + position + 1, warm_up->prefetched + position,
+                        (warm_up->prefetched_count - position) * sizeof(uint64_t));
+                warm_up->prefetched[position] = inode;
+                warm_up->prefetched_count++;
+            }
+            if(!is_repeated) prefetch_file(warm_up, file_descriptor, file_status.st_size);
+        }
+        if(file_descriptor >= 0) close(file_descriptor);
+    }
+    fclose(file);
+}
+
+/**
+ * Crawls directories of the public folder until there are none left or the
+ * warm-up deadline expires. Every directory is listed with getdents64 and
+ * every entry is inspected with statx: subdirectories are queued for any of
+ * the crawling threads, and regular files are prefetched. Symbolic links are
+ * not followed.
+ *
+ * @param argument the <B>HttpWarmUp</B> state
+ *
+ * @return a pointer to this method
+ */
+void * crawl_public_folder(void * argument) {
+    HttpWarmUp * warm_up = (HttpWarmUp *) argument;
+    char entries[8192];
+
+    pthread_mutex_lock(&warm_up->mutex);
+    while(true) {
+        while(warm_up->directory_count == 0 && warm_up->active > 0) {
+            pthread_cond_wait(&warm_up->condition, &warm_up->mutex);
+        }
+        if(warm_up->directory_count == 0 || monotonic_milliseconds() >= warm_up->deadline) break;
+        char * directory = warm_up->directories[--warm_up->directory_count];
+        warm_up->active++;
+        pthread_mutex_unlock(&warm_up->mutex);
+
+        int directory_descriptor = openat(public_folder_descriptor, directory, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        long bytes;
+        while(directory_descriptor >= 0 && monotonic_milliseconds() < warm_up->deadline
+              && (bytes = syscall(SYS_getdents64, directory_descriptor, entries, sizeof(entries))) > 0) {
+            for(long offset = 0; offset < bytes; offset += ((struct dirent64 *) (entries + offset))->d_reclen) {
+                struct dirent64 * entry = (struct dirent64 *) (entries + offset);
+                if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+                struct statx entry_status;
+                if(statx(directory_descriptor, entry->d_name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE | STATX_INO, &entry_status) != 0) continue;
+
+                if(S_ISDIR(entry_status.stx_mode)) {
+                    char * subdirectory = malloc(strlen(directory) + strlen(entry->d_name) + 2);
+                    if(subdirectory == NULL) continue;
+                    sprintf(subdirectory, "%s/%s", directory, entry->d_name);
+                    pthread_mutex_lock(&warm_up->mutex);
+                    if(warm_up->directory_count == warm_up->directory_capacity) {
+                        int capacity = warm_up->directory_capacity * 2 + 16;
+                        char ** directories = realloc(warm_up->directories, capacity * sizeof(char *));
+                        if(directories != NULL) {
+                            warm_up->directories = directories;
+                            warm_up->directory_capacity = capacity;
+                        }
+                    }
+                    if(warm_up->directory_count < warm_up->directory_capacity) {
+                        warm_up->directories[warm_up->directory_count++] = subdirectory;
+                        subdirectory = NULL;
+                        pthread_cond_signal(&warm_up->condition);
+                    }
+                    pthread_mutex_unlock(&warm_up->mutex);
+                    free(subdirectory);
+                } else if(S_ISREG(entry_status.stx_mode)
+                          && (warm_up->prefetched_count == 0
+                              || bsearch(&entry_status.stx_ino, warm_up->prefetched, warm_up->prefetched_count,
+                                         sizeof(uint64_t), compare_inodes) == NULL)) {
+                    int file_descriptor = openat(directory_descriptor, entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+                    if(file_descriptor < 0) continue;
+                    prefetch_file(warm_up, file_descriptor, entry_status.stx_size);
+                    close(file_descriptor);
+                }
+            }
+        }
+        if(directory_descriptor >= 0) close(directory_descriptor);
+        free(directory);
+
+        pthread_mutex_lock(&warm_up->mutex);
+        warm_up->active--;
+        // The last busy thread finding nothing queued ends the crawl
+        if(warm_up->active == 0 && warm_up->directory_count == 0) pthread_cond_broadcast(&warm_up->condition);
+    }
+    pthread_cond_broadcast(&warm_up->condition);
+    pthread_mutex_unlock(&warm_up->mutex);
+    return NULL;
+}
+
+/**
+ * Warms the page cache and the kernel path lookup caches up before the server
+ * starts accepting connections: the files of the manifest are prefetched
+ * first, and then the whole public folder is crawled in parallel, until the
+ * warm-up budget is used up or the warm-up deadline expires.
+ */
+void warm_up_public_folder() {
+    HttpWarmUp warm_up;
+    memset(&warm_up, 0, sizeof(warm_up));
+    warm_up.budget = (int64_t) configuration.warm_up_budget * 1024 * 1024;
+    warm_up.deadline = monotonic_milliseconds() + configuration.warm_up_timeout;
+    pthread_mutex_init(&warm_up.mutex, NULL);
+    pthread_cond_init(&warm_up.condition, NULL);
+    uint64_t started = monotonic_milliseconds();
+
+    if(configuration.warm_up_manifest != NULL) prefetch_manifest(&warm_up, configuration.warm_up_manifest);
+
+    // The crawl starts at the public folder itself
+    warm_up.directories = malloc(16 * sizeof(char *));
+    warm_up.directory_capacity = warm_up.directories != NULL ? 16 : 0;
+    if(warm_up.directories != NULL && (warm_up.directories[0] = strdup(".")) != NULL) {
+        warm_up.directory_count = 1;
+    }
+
+    pthread_t threads[configuration.warm_up_threads];
+    int thread_count = 0;
+    while(thread_count < configuration.warm_up_threads
+          && pthread_create(&threads[thread_count], NULL, crawl_public_folder, &warm_up) == 0) {
+        thread_count++;
+    }
+    for(int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Directories left over when the deadline expired
+    for(int i = 0; i < warm_up.directory_count; i++) {
+        free(warm_up.directories[i]);
+    }
+    free(warm_up.directories);
+    free(warm_up.prefetched);
+    pthread_mutex_destroy(&warm_up.mutex);
+    pthread_cond_destroy(&warm_up.condition);
+
+    printf("[Server] Warm-up prefetched %ld files (%ld bytes) in %lu ms%s\n", (long) warm_up.files, (long) warm_up.bytes,
+           (unsigned long) (monotonic_milliseconds() - started), monotonic_milliseconds() >= warm_up.deadline ? ", deadline expired" : "");
+    fflush(stdout);
+}
+
+/**
+ * Resolves the given upstream name ("host:port" or "unix:/path/to/socket")
+ * into the address of the given <B>HttpUpstream</B>.
+ *
+ * @param upstream a pointer to the <B>HttpUpstream</B> to be filled
+ * @param name the upstream name
+ *
+ * @return 0 if the name was resolved and 1 otherwise.
+ */
+int resolve_upstream_address(HttpUpstream * upstream, char * name) {
+    memset(&upstream->address, 0, sizeof(upstream->address));
+
+    if(strncmp(name, "unix:", 5) == 0) {
+        struct sockaddr_un * address = (struct sockaddr_un *) &upstream->address;
+        if(strlen(name + 5) == 0 || strlen(name + 5) >= sizeof(address->sun_path)) return 1;
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, name + 5);
+        upstream->address_length = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    char * separator = strrchr(name, ':');
+    if(separator == NULL) return 1;
+    (* separator) = '\0';
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    struct addrinfo * result;
+    int status = getaddrinfo(name, separator + 1, &hints, &result);
+    (* separator) = ':';
+    if(status != 0) return 1;
+
+    memcpy(&upstream->address, result->ai_addr, result->ai_addrlen);
+    upstream->address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+/**
+ * Returns a pointer to a new allocated <B>HttpRoute</B> structure parsed
+ * from the given definition, which has the form
+ * "<uri prefix> <upstream>[,<upstream>...]".
+ *
+ * The returned structure and its contents should be freed by the client.
+ *
+ * @param definition the route definition
+ *
+ * @return a pointer to a new allocated <B>HttpRoute</B> structure, or
+ *         <I>NULL</I> if there is no enough space for allocation or the
+ *         definition is invalid
+ */
+HttpRoute * create_http_route(const char * definition) {
+    char * to_tokenize = strdup(definition);
+    if(to_tokenize == NULL) return NULL;
+
+    char * context = to_tokenize;
+    char * prefix = strtok_r(to_tokenize, " \t", &context);
+    char * upstreams = strtok_r(NULL, " \t", &context);
+    if(prefix == NULL || prefix[0] != '/' || upstreams == NULL) {
+        fprintf(stderr, "Invalid proxy route: %s\n", definition);
+        fflush(stderr);
+        free(to_tokenize);
+        return NULL;
+    }
+
+    HttpRoute * route = calloc(1, sizeof(HttpRoute));
+    if(route == NULL) {
+        fprintf(stderr, "Failed to allocate memory for http route: %s\n", strerror(errno));
+        fflush(stderr);
+        free(to_tokenize);
+        return NULL;
+    }
+
+    int count = 1;
+    for(char * traversal = upstreams; (* traversal) != '\0'; traversal++) {
+        if((* traversal) == ',') count++;
+    }
+
+    route->prefix = strdup(prefix);
+    route->upstreams = calloc(count, sizeof(HttpUpstream));
+    if(route->prefix == NULL || route->upstreams == NULL) {
+        fprintf(stderr, "Failed to allocate memory for http route: %s\n", strerror(errno));
+        fflush(stderr);
+        free(route->prefix);
+        free(route->upstreams);
+        free(route);
+        free(to_tokenize);
+        return NULL;
+    }
+
+    char * upstream_context = upstreams;
+    char * name = strtok_r(upstreams, ",", &upstream_context);
+    while(name != NULL) {
+        HttpUpstream * upstream = &route->upstreams[route->upstream_count];
+        upstream->name = strdup(name);
+        pthread_mutex_init(&upstream->mutex, NULL);
+        route->upstream_count++;
+        if(upstream->name == NULL || resolve_upstream_address(upstream, name) != 0) {
+            fprintf(stderr, "Invalid proxy upstream: %s\n", name);
+            fflush(stderr);
+            free(to_tokenize);
+            return NULL;
+        }
+        name = strtok_r(NULL, ",", &upstream_context);
+    }
+
+    free(to_tokenize);
+    return route;
+}
+
+/**
+ * Returns the first proxy route whose prefix matches the given uri.
+ *
+ * @param uri the requested uri
+ *
+ * @return a pointer to the matching <B>HttpRoute</B>, or <I>NULL</I> if
+ *         the uri should be served from the public folder
+ */
+HttpRoute * find_http_route(char * uri) {
+    HttpRoute * route = routes;
+    while(route != NULL) {
+        if(strncmp(uri, route->prefix, strlen(route->prefix)) == 0) return route;
+        route = route->next;
+    }
+    return NULL;
+}
+
+/**
+ * Selects the upstream that should receive the next request of the given
+ * route. Upstreams are picked in round robin order skipping the ones that
+ * failed recently, and if all of them failed the one that will recover
+ * first is picked.
+ *
+ * @param route the route of the request
+ *
+ * @return a pointer to the selected <B>HttpUpstream</B>
+ */
+HttpUpstream * select_upstream(HttpRoute * route) {
+    uint64_t now = monotonic_milliseconds();
+    unsigned int start = __atomic_fetch_add(&route->next_upstream, 1, __ATOMIC_RELAXED);
+    HttpUpstream * fallback = NULL;
+    uint64_t fallback_retry_after = UINT64_MAX;
+
+    for(int i = 0; i < route->upstream_count; i++) {
+        HttpUpstream * upstream = &route->upstreams[(start + i) % route->upstream_count];
+        pthread_mutex_lock(&upstream->mutex);
+        uint64_t retry_after = upstream->retry_after;
+        pthread_mutex_unlock(&upstream->mutex);
+        if(retry_after <= now) return upstream;
+        if(retry_after < fallback_retry_after) {
+            fallback = upstream;
+            fallback_retry_after = retry_after;
+        }
+    }
+    return fallback;
+}
+
+/**
+ * Records the outcome of an exchange with the given upstream. After too many
+ * consecutive failures the upstream is skipped for a while.
+ *
+ * @param upstream the upstream the exchange was performed with
+ * @param healthy whether the exchange succeeded
+ */
+void report_upstream(HttpUpstream * upstream, bool healthy) {
+    pthread_mutex_lock(&upstream->mutex);
+    if(healthy) {
+        upstream->failures = 0;
+        upstream->retry_after = 0;
+    } else if(++upstream->failures >= UPSTREAM_MAX_FAILS) {
+        uint64_t now = monotonic_milliseconds();
+        if(upstream->retry_after <= now) {
+            printf("[Server] Upstream %s marked as unavailable\n", upstream->name);
+            fflush(stdout);
+        }
+        upstream->retry_after = now + UPSTREAM_FAIL_TIMEOUT_MS;
+    }
+    pthread_mutex_unlock(&upstream->mutex);
+}
+
+/**
+ * Opens a new connection to the given upstream, waiting at most the upstream
+ * connect timeout for it to be established.
+ *
+ * The returned structure should be released by the client.
+ *
+ * @param upstream the upstream to connect to
+ *
+ * @return a pointer to a new allocated <B>HttpUpstreamConnection</B>, or
+ *         <I>NULL</I> if the connection could not be established
+ */
+HttpUpstreamConnection * connect_upstream(HttpUpstream * upstream) {
+    int family = upstream->address.ss_family;
+    int socket_descriptor = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(socket_descriptor < 0) return NULL;
+
+    int result = connect(socket_descriptor, (struct sockaddr *) &upstream->address, upstream->address_length);
+    if(result < 0 && errno == EINPROGRESS) {
+        struct pollfd pending = { socket_descriptor, POLLOUT, 0 };
+        int error = ETIMEDOUT;
+        socklen_t error_length = sizeof(error);
+        if(poll(&pending, 1, UPSTREAM_CONNECT_TIMEOUT_MS) == 1) {
+            getsockopt(socket_descriptor, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        }
+        result = error == 0 ? 0 : -1;
+    }
+
+    HttpUpstreamConnection * upstream_connection = result == 0 ? malloc(sizeof(HttpUpstreamConnection)) : NULL;
+    if(upstream_connection == NULL) {
+        close(socket_descriptor);
+        return NULL;
+    }
+
+    // The handler threads use blocking I/O, the timer wheel bounds how long they can wait
+    fcntl(socket_descriptor, F_SETFL, fcntl(socket_descriptor, F_GETFL) & ~O_NONBLOCK);
+    if(family != AF_UNIX) {
+        int enabled = 1;
+        setsockopt(socket_descriptor, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+    }
+
+    upstream_connection->socket_descriptor = socket_descriptor;
+    upstream_connection->timer.expires = 0;
+    upstream_connection->timer.socket_descriptor = socket_descriptor;
+    upstream_connection->timer.deadline = NULL;
+    upstream_connection->timer.expired = false;
+    upstream_connection->timer.next = NULL;
+    upstream_connection->timer.link = NULL;
+    upstream_connection->next = NULL;
+    return upstream_connection;
+}
+
+/**
+ * Returns a connection to the given upstream, reusing an idle one from the
+ * pool when possible. Pooled connections that were closed by the upstream
+ * while idle are discarded.
+ *
+ * @param upstream the upstream to get a connection to
+ * @param pooled set to true if the returned connection was reused
+ *
+ * @return a pointer to a <B>HttpUpstreamConnection</B>, or <I>NULL</I>
+ *         if a new connection could not be established
+ */
+HttpUpstreamConnection * acquire_upstream_connection(HttpUpstream * upstream, bool * pooled) {
+    while(true) {
+        pthread_mutex_lock(&upstream->mutex);
+        HttpUpstreamConnection * upstream_connection = upstream->idle;
+        if(upstream_connection != NULL) {
+            upstream->idle = upstream_connection->next;
+            upstream->idle_count--;
+        }
+        pthread_mutex_unlock(&upstream->mutex);
+
+        if(upstream_connection == NULL) break;
+
+        // An idle connection must have nothing to read, otherwise it was closed (or is broken)
+        char probe;
+        if(recv(upstream_connection->socket_descriptor, &probe, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+           && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            upstream_connection->timer.expired = false;
+            (* pooled) = true;
+            return upstream_connection;
+        }
+        close(upstream_connection->socket_descriptor);
+        free(upstream_connection);
+    }
+
+    (* pooled) = false;
+    return connect_upstream(upstream);
+}
+
+/**
+ * Gives back a connection obtained from <B>acquire_upstream_connection</B>,
+ * keeping it in the pool if it can be reused and the pool is not full, and
+ * closing it otherwise.
+ *
+ * @param upstream the upstream of the connection
+ * @param upstream_connection the connection to be released
+ * @param reusable whether the last exchange left the connection ready for another request
+ */
+void release_upstream_connection(HttpUpstream * upstream, HttpUpstreamConnection * upstream_connection, bool reusable) {
+    cancel_timer(&upstream_connection->timer);
+    if(reusable && !upstream_connection->timer.expired) {
+        pthread_mutex_lock(&upstream->mutex);
+        if(upstream->idle_count < UPSTREAM_POOL_SIZE) {
+            upstream_connection->next = upstream->idle;
+            upstream->idle = upstream_connection;
+            upstream->idle_count++;
+            upstream_connection = NULL;
+        }
+        pthread_mutex_unlock(&upstream->mutex);
+    }
+    if(upstream_connection != NULL) {
+        close(upstream_connection->socket_descriptor);
+        free(upstream_connection);
+    }
+}
+
+/**
+ * Sends all the given bytes to the given upstream connection, re-arming its
+ * stall deadline after every write.
+ *
+ * @param upstream_connection the upstream connection to send the data to
+ * @param data the bytes to be sent
+ * @param length the number of bytes to be sent
+ *
+ * @return 0 if all the bytes were sent and 1 otherwise.
+ */
+int send_upstream(HttpUpstreamConnection * upstream_connection, const char * data, size_t length) {
+    while(length > 0) {
+        ssize_t bytes = send(upstream_connection->socket_descriptor, data, length, MSG_NOSIGNAL);
+        if(bytes < 0 && errno == EINTR) continue;
+        if(bytes <= 0) return 1;
+        data += bytes;
+        length -= bytes;
+        arm_timer(&upstream_connection->timer, monotonic_milliseconds() + UPSTREAM_TIMEOUT_MS, "upstream");
+    }
+    return 0;
+}
+
+/**
+ * Moves bytes from one socket to another through the given pipe, without
+ * copying them to user space (unless the client end is a TLS connection that
+ * the kernel can not encrypt or decrypt by itself). The upstream stall deadline is re-armed after
+ * every chunk, as is the client body deadline when receiving from the client.
+ * When sending to the client the send deadline only runs while writing.
+ *
+ * @param from the socket to read from
+ * @param to the socket to write to
+ * @param pipe_descriptors a pipe used as the intermediate kernel buffer
+ * @param length the number of bytes to move, or -1 to move until the end of the stream
+ * @param connection the client connection
+ * @param upstream_connection the upstream connection
+ *
+ * @return the number of bytes moved, or -1 if writing failed or the stream ended
+ *         before the requested length was reached
+ */
+long splice_stream(int from, int to, int pipe_descriptors[2], long length,
+                   HttpConnection * connection, HttpUpstreamConnection * upstream_connection) {
+    long moved = 0;
+
+    // Bytes of a TLS connection without kernel TLS must go through OpenSSL, so they are copied instead
+    bool to_client = to == connection->socket_descriptor;
+    if(!to_client) arm_timer(&connection->timer, monotonic_milliseconds() + BODY_TIMEOUT_MS, "body");
+    if(!connection_is_zero_copy(connection, to_client)) {
+        HttpBuffer * buffer = acquire_buffer();
+        if(buffer == NULL) return -1;
+        while(length < 0 || moved < length) {
+            size_t chunk = length < 0 || length - moved > buffer->capacity ? (size_t) buffer->capacity : (size_t) (length - moved);
+            ssize_t bytes = to_client ? recv(from, buffer->data, chunk, 0) : connection_receive(connection, buffer->data, chunk);
+            if(bytes < 0 && errno == EINTR) continue;
+            int result = bytes > 0 ? (to_client ? send_all(connection, buffer->data, bytes) : send_upstream(upstream_connection, buffer->data, bytes)) : 1;
+            if(result != 0) {
+                if(bytes == 0 && length < 0) break;
+                moved = -1;
+                break;
+            }
+            moved += bytes;
+            arm_timer(&upstream_connection->timer, monotonic_milliseconds() + UPSTREAM_TIMEOUT_MS, "upstream");
+            if(!to_client) arm_timer(&connection->timer, monotonic_milliseconds() + BODY_TIMEOUT_MS, "body");
+        }
+        release_buffers(buffer);
+        return moved;
+    }
+
+    while(length < 0 || moved < length) {
+        size_t chunk = length < 0 || length - moved > PROXY_SPLICE_SIZE ? PROXY_SPLICE_SIZE : (size_t) (length - moved);
+        ssize_t pending = splice(from, NULL, pipe_descriptors[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(pending < 0 && errno == EINTR) continue;
+        if(pending < 0) return -1;
+        if(pending == 0) return length < 0 ? moved : -1;
+
+        if(to_client) arm_send_timer(connection, 0);
+        while(pending > 0) {
+            ssize_t bytes = splice(pipe_descriptors[0], NULL, to, NULL, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(bytes < 0 && errno == EINTR) continue;
+            if(bytes <= 0) return -1;
+            pending -= bytes;
+            moved += bytes;
+            if(to_client) arm_send_timer(connection, bytes);
+        }
+        if(to_client) pause_send_timer(connection);
+        else arm_timer(&connection->timer, monotonic_milliseconds() + BODY_TIMEOUT_MS, "body");
+        arm_timer(&upstream_connection->timer, monotonic_milliseconds() + UPSTREAM_TIMEOUT_MS, "upstream");
+    }
+    return moved;
+}
+
+/**
+ * Follows the framing of a chunked body through the given bytes, so the end
+ * of the body can be found while relaying it.
+ *
+ * @param tracker the state of the chunked body (zero initialized at the start of the body),
+ *        its done flag is set once the end of the body is reached
+ * @param data the next bytes of the body
+ * @param length the number of bytes
+ *
+ * @return the number of bytes that belong to the body, which is smaller than
+ *         the given length only when the end of the body was reached, or -1
+ *         if the framing is invalid
+ */
+long track_chunks(HttpChunkTracker * tracker, const char * data, long length) {
+    // Size line, size extension, chunk data, crlf after data, trailer line start, trailer line
+    static const int SIZE = 0, EXTENSION = 1, DATA = 2, DATA_END = 3, TRAILER_START = 4, TRAILER = 5;
+
+    long position = 0;
+    while(position < length && !tracker->done) {
+        char current = data[position];
+        if(tracker->state == DATA) {
+            long available = length - position;
+            long skipped = available < tracker->remaining ? available : tracker->remaining;
+            position += skipped;
+            tracker->remaining -= skipped;
+            if(tracker->remaining == 0) tracker->state = DATA_END;
+            continue;
+        }
+        position++;
+        if(tracker->state == SIZE && isxdigit(current)) {
+            if(tracker->remaining > (LONG_MAX >> 4)) return -1;
+            tracker->remaining = tracker->remaining * 16 + (isdigit(current) ? current - '0' : tolower(current) - 'a' + 10);
+        } else if((tracker->state == SIZE || tracker->state == EXTENSION) && current == '\n') {
+            tracker->state = tracker->remaining == 0 ? TRAILER_START : DATA;
+        } else if(tracker->state == SIZE && current == ';') {
+            tracker->state = EXTENSION;
+        } else if(tracker->state == SIZE && current != '\r' && current != ' ' && current != '\t') {
+            return -1;
+        } else if(tracker->state == DATA_END && current == '\n') {
+            tracker->state = SIZE;
+        } else if(tracker->state == DATA_END && current != '\r') {
+            return -1;
+        } else if(tracker->state == TRAILER_START && current == '\n') {
+            tracker->done = true;
+        } else if(tracker->state == TRAILER_START && current != '\r') {
+            tracker->state = TRAILER;
+        } else if(tracker->state == TRAILER && current == '\n') {
+            tracker->state = TRAILER_START;
+        }
+    }
+    return position;
+}
+
+/**
+ * Checks whether the given header line is hop-by-hop, meaning that it
+ * applies only to a single connection and must not be forwarded. Besides
+ * the standard ones, every header named in the Connection header is.
+ *
+ * @param line a header line
+ * @param connection the value of the Connection header of the message, or <I>NULL</I>
+ *
+ * @return true if the header must not be forwarded, false otherwise
+ */
+bool is_hop_by_hop_header(const char * line, const char * connection) {
+    if(strncasecmp(line, "Connection:", 11) == 0
+       || strncasecmp(line, "Keep-Alive:", 11) == 0
+       || strncasecmp(line, "Proxy-Connection:", 17) == 0
+       || strncasecmp(line, "Upgrade:", 8) == 0
+       || strncasecmp(line, "TE:", 3) == 0
+       || strncasecmp(line, "Trailer:", 8) == 0
+       || strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+        return true;
+    }
+
+    size_t name_length = strcspn(line, ":\r\n");
+    while(connection != NULL && (* connection) != '\r' && (* connection) != '\0') {
+        size_t token_length = strcspn(connection, ", \t\r\n");
+        if(token_length == name_length && strncasecmp(connection, line, name_length) == 0) return true;
+        connection += token_length;
+        connection += strspn(connection, ", \t");
+    }
+    return false;
+}
+
+/**
+ * Checks that the body of the given request is framed in a way both the
+ * proxy and any upstream read the same: no Transfer-Encoding (chunked
+ * request bodies are not supported), and at most one Content-Length made
+ * only of digits. Anything else could let a body be read as another request.
+ *
+ * @param message a received http request
+ * @param headers_end a pointer to the "\r\n\r\n" ending the headers in the message
+ *
+ * @return true if the request can be forwarded, false otherwise
+ */
+bool has_unambiguous_body_length(char * message, char * headers_end) {
+    if(find_header_value(message, headers_end, "Transfer-Encoding") != NULL) return false;
+
+    char * value = find_header_value(message, headers_end, "Content-Length");
+    if(value == NULL) return true;
+    size_t digits = strspn(value, "0123456789");
+    char * value_end = value + digits + strspn(value + digits, " \t");
+    if(digits == 0 || digits > 18 || strncmp(value_end, "\r\n", 2) != 0) return false;
+
+    // A second Content-Length header is ambiguous even with the same value
+    return find_header_value(value_end, headers_end, "Content-Length") == NULL;
+}
+
+/**
+ * Copies the header lines between the given pointers skipping the hop-by-hop
+ * ones, each copied line keeps its "\r\n".
+ *
+ * @param destination the buffer to copy the lines to (as large as the lines)
+ * @param lines a pointer to the start of the first header line
+ * @param headers_end a pointer to the "\r\n\r\n" ending the headers
+ *
+ * @return the number of bytes copied
+ */
+size_t copy_end_to_end_headers(char * destination, char * lines, char * headers_end) {
+    // The lines start right after the "\r\n" of the start line
+    char * connection = find_header_value(lines - 2, headers_end, "Connection");
+    size_t copied = 0;
+    while(lines < headers_end + 2) {
+        char * line_end = strstr(lines, "\r\n") + 2;
+        if(!is_hop_by_hop_header(lines, connection)) {
+            memcpy(destination + copied, lines, line_end - lines);
+            copied += line_end - lines;
+        }
+        lines = line_end;
+    }
+    return copied;
+}
+
+/**
+ * Forwards the given request to one of the upstreams of the given route and
+ * streams the response back to the client. Request and response bodies are
+ * moved with splice, except chunked responses which are relayed through a
+ * buffer to find where they end. Upstream connections are kept alive and
+ * returned to the pool whenever the response ended cleanly.
+ *
+ * @param connection the client connection
+ * @param route the route that matched the request
+ * @param http_request the parsed request
+ * @param message the received request message
+ * @param received the number of bytes of the received message
+ */
+void proxy_request(HttpConnection * connection, HttpRoute * route, HttpRequest * http_request, char * message, int received) {
+    char * request_headers_end = strstr(message, "\r\n\r\n");
+    if(request_headers_end == NULL || !has_unambiguous_body_length(message, request_headers_end)) {
+        send_http_header(connection, 400, NULL);
+        return;
+    }
+
+    // ## 1. BUILDING THE UPSTREAM REQUEST HEAD ##
+
+    // Always talk HTTP/1.1 to the upstream so the connection can be kept alive
+    char * head = malloc(strlen(http_request->method) + strlen(http_request->uri) + received + 64);
+    if(head == NULL) {
+        send_http_header(connection, 503, NULL);
+        return;
+    }
+    size_t head_length = sprintf(head, "%s %s HTTP/1.1\r\n", http_request->method, http_request->uri);
+    head_length += copy_end_to_end_headers(head + head_length, strstr(message, "\r\n") + 2, request_headers_end);
+    head_length += sprintf(head + head_length, "Connection: keep-alive\r\n\r\n");
+
+    // Only the declared body is forwarded, bytes received after it are never sent to the upstream
+    char * buffered_body = request_headers_end + 4;
+    long content_length = parse_content_length(message, request_headers_end);
+    long request_body_length = content_length > 0 ? content_length : 0;
+    long buffered_body_length = received - (buffered_body - message);
+    if(buffered_body_length > request_body_length) buffered_body_length = request_body_length;
+    long pending_body_length = request_body_length - buffered_body_length;
+
+    int pipe_descriptors[2];
+    HttpBuffer * response_buffer = NULL;
+    if(pipe2(pipe_descriptors, O_CLOEXEC) != 0) {
+        free(head);
+        send_http_header(connection, 503, NULL);
+        return;
+    }
+    if((response_buffer = acquire_buffer()) == NULL) {
+        free(head);
+        close(pipe_descriptors[0]);
+        close(pipe_descriptors[1]);
+        send_http_header(connection, 503, NULL);
+        return;
+    }
+
+    char * response = response_buffer->data;
+    HttpUpstream * upstream = NULL;
+    HttpUpstreamConnection * upstream_connection = NULL;
+    char * response_headers_end = NULL;
+    int response_length = 0;
+
+    // ## 2. SENDING THE REQUEST AND RECEIVING THE RESPONSE HEAD ##
+
+    // The header deadline of the client does not apply to the upstream, which has its own deadline
+    cancel_timer(&connection->timer);
+
+    // A pooled connection may have been closed by the upstream right before being reused, in that case
+    // the request is retried once on a new connection, but only when its method is idempotent (RFC 9110
+    // section 9.2.2): the upstream may have processed it before closing the connection
+    const char * method = http_request->method;
+    bool is_idempotent = strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 || strcmp(method, "OPTIONS") == 0
+                         || strcmp(method, "TRACE") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "DELETE") == 0;
+    for(int attempt = 0; attempt < 2 && response_headers_end == NULL; attempt++) {
+        bool pooled = false;
+        upstream = select_upstream(route);
+        upstream_connection = acquire_upstream_connection(upstream, &pooled);
+        if(upstream_connection == NULL) {
+            report_upstream(upstream, false);
+            continue;
+        }
+        arm_timer(&upstream_connection->timer, monotonic_milliseconds() + UPSTREAM_TIMEOUT_MS, "upstream");
+
+        bool sent = send_upstream(upstream_connection, head, head_length) == 0
+                    && send_upstream(upstream_connection, buffered_body, buffered_body_length) == 0;
+        if(sent && pending_body_length > 0) {
+            sent = splice_stream(connection->socket_descriptor, upstream_connection->socket_descriptor,
+                                 pipe_descriptors, pending_body_length, connection, upstream_connection) >= 0;
+            cancel_timer(&connection->timer);
+            // The request body can not be replayed anymore
+            pooled = false;
+        }
+
+        response_length = 0;
+        while(sent && response_headers_end == NULL && response_length < configuration.buffer_size - 1) {
+            int bytes = recv(upstream_connection->socket_descriptor, response + response_length, configuration.buffer_size - 1 - response_length, 0);
+            if(bytes < 0 && errno == EINTR) continue;
+            if(bytes <= 0) break;
+            response_length += bytes;
+            response[response_length] = '\0';
+            response_headers_end = strstr(response, "\r\n\r\n");
+        }
+
+        if(response_headers_end == NULL) {
+            bool timed_out = upstream_connection->timer.expired;
+            release_upstream_connection(upstream, upstream_connection, false);
+            upstream_connection = NULL;
+            bool is_stale = pooled && response_length == 0 && !timed_out;
+            if(is_stale && is_idempotent) continue;
+            // A stale pooled connection says nothing about the health of the upstream
+            if(!is_stale) report_upstream(upstream, false);
+            send_http_header(connection, timed_out ? 504 : 502, NULL);
+            break;
+        }
+    }
+    free(head);
+
+    if(response_headers_end == NULL) {
+        if(upstream_connection == NULL && connection->bytes_sent == 0) send_http_header(connection, 502, NULL);
+        release_buffers(response_buffer);
+        close(pipe_descriptors[0]);
+        close(pipe_descriptors[1]);
+        return;
+    }
+
+    // ## 3. RELAYING THE RESPONSE HEAD ##
+
+    int status_code = strncmp(response, "HTTP/1.", 7) == 0 ? atoi(response + 9) : 0;
+    connection->status_code = status_code;
+    bool reusable = strncmp(response, "HTTP/1.1", 8) == 0
+                    && !header_has_token(response, response_headers_end, "Connection", "close");
+    bool chunked = header_has_token(response, response_headers_end, "Transfer-Encoding", "chunked");
+    long body_length = parse_content_length(response, response_headers_end);
+    if(strcmp(http_request->method, "HEAD") == 0 || status_code / 100 == 1 || status_code == 204 || status_code == 304) {
+        body_length = 0;
+        chunked = false;
+    }
+
+    // The client connection is closed after every response
+    char * client_head = malloc((response_headers_end - response) + 64);
+    bool relayed = client_head != NULL;
+    if(relayed) {
+        char * status_line_end = strstr(response, "\r\n") + 2;
+        size_t client_head_length = status_line_end - response;
+        memcpy(client_head, response, client_head_length);
+        client_head_length += copy_end_to_end_headers(client_head + client_head_length, status_line_end, response_headers_end);
+        // Chunks are relayed as they are, so the client gets the same framing
+        if(chunked) client_head_length += sprintf(client_head + client_head_length, "Transfer-Encoding: chunked\r\n");
+        client_head_length += sprintf(client_head + client_head_length, "Connection: close\r\n\r\n");
+        relayed = send_all(connection, client_head, client_head_length) == 0;
+        trace_stage(connection, TRACE_HEADERS_SENT);
+        free(client_head);
+    }
+
+    // ## 4. RELAYING THE RESPONSE BODY ##
+
+    char * body = response_headers_end + 4;
+    long body_received = response_length - (body - response);
+
+    if(relayed && chunked) {
+        HttpChunkTracker tracker = { 0, 0, false };
+        long consumed = track_chunks(&tracker, body, body_received);
+        relayed = consumed >= 0 && send_all(connection, body, consumed) == 0;
+        // Anything received after the end of the body means the upstream is out of sync
+        reusable = reusable && consumed == body_received;
+        while(relayed && !tracker.done) {
+            int bytes = recv(upstream_connection->socket_descriptor, response, configuration.buffer_size, 0);
+            if(bytes < 0 && errno == EINTR) continue;
+            if(bytes <= 0) {
+                relayed = false;
+                break;
+            }
+            arm_timer(&upstream_connection->timer, monotonic_milliseconds() + UPSTREAM_TIMEOUT_MS, "upstream");
+            consumed = track_chunks(&tracker, response, bytes);
+            relayed = consumed >= 0 && send_all(connection, response, consumed) == 0;
+            reusable = reusable && consumed == bytes;
+        }
+    } else if(relayed && body_length >= 0) {
+        long buffered = body_received < body_length ? body_received : body_length;
+        reusable = reusable && body_received <= body_length;
+        relayed = send_all(connection, body, buffered) == 0
+                  && splice_stream(upstream_connection->socket_descriptor, connection->socket_descriptor,
+                                   pipe_descriptors, body_length - buffered, connection, upstream_connection) >= 0;
+    } else if(relayed) {
+        // Without a length the body ends when the upstream closes the connection
+        reusable = false;
+        relayed = send_all(connection, body, body_received) == 0
+                  && splice_stream(upstream_connection->socket_descriptor, connection->socket_descriptor,
+                                   pipe_descriptors, -1, connection, upstream_connection) >= 0;
+    }
+
+    report_upstream(upstream, relayed || !upstream_connection->timer.expired);
+    release_upstream_connection(upstream, upstream_connection, reusable && relayed);
+    release_buffers(response_buffer);
+    close(pipe_descriptors[0]);
+    close(pipe_descriptors[1]);
+}
+
+#ifdef ENABLE_TLS
+/**
+ * Returns a new TLS server context loaded with the configured certificate
+ * chain and private key. Sessions can be resumed both with stateless tickets
+ * and with the server side session cache, and kernel TLS is requested so the
+ * kernel takes over the symmetric crypto after every handshake.
+ *
+ * The returned context should be freed by the client.
+ *
+ * @return a new TLS context, or <I>NULL</I> if it could not be created
+ */
+SSL_CTX * create_tls_context() {
+    SSL_CTX * context = SSL_CTX_new(TLS_server_method());
+    if(context == NULL) return NULL;
+
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+#ifdef ENABLE_KTLS
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    SSL_CTX_set_session_id_context(context, (const unsigned char *) "http-server-in-c", strlen("http-server-in-c"));
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(context, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(context, TLS_SESSION_TIMEOUT);
+
+    if(SSL_CTX_use_certificate_chain_file(context, configuration.tls_certificate) != 1
+       || SSL_CTX_use_PrivateKey_file(context, configuration.tls_private_key, SSL_FILETYPE_PEM) != 1
+       || SSL_CTX_check_private_key(context) != 1) {
+        ERR_print_errors_fp(stderr);
+        fflush(stderr);
+        SSL_CTX_free(context);
+        return NULL;
+    }
+    return context;
+}
+
+/**
+ * Performs the TLS handshake of the given connection, which must be completed
+ * before the header deadline. Afterwards it records whether kernel TLS took
+ * over sending and receiving.
+ *
+ * @param connection a connection accepted on a TLS listener
+ *
+ * @return 0 if the handshake succeeded and 1 otherwise.
+ */
+int accept_tls_connection(HttpConnection * connection) {
+    arm_timer(&connection->timer, monotonic_milliseconds() + HEADER_TIMEOUT_MS, "handshake");
+    if(SSL_accept(connection->tls) != 1) {
+        ERR_clear_error();
+        return 1;
+    }
+#ifdef ENABLE_KTLS
+    connection->ktls_send = BIO_get_ktls_send(SSL_get_wbio(connection->tls)) == 1;
+    connection->ktls_receive = BIO_get_ktls_recv(SSL_get_rbio(connection->tls)) == 1;
+#endif
+    return 0;
+}
+#endif
+
+/**
+ * Applies the configured connection setup options to the given TCP listening
+ * socket (also to inherited ones, the configuration may have changed). The
+ * socket is made non-blocking so the accept loop can drain it in batches.
+ * Kernels without deferred accepts or TCP Fast Open just ignore them.
+ *
+ * @param socket_descriptor the descriptor of a TCP socket
+ */
+void tune_tcp_listener(int socket_descriptor) {
+    fcntl(socket_descriptor, F_SETFL, fcntl(socket_descriptor, F_GETFL) | O_NONBLOCK);
+    // Wake the accept loop up only once the request bytes arrived, and let repeat clients send them in the SYN
+    setsockopt(socket_descriptor, IPPROTO_TCP, TCP_DEFER_ACCEPT, &configuration.defer_accept, sizeof(configuration.defer_accept));
+    if(configuration.fast_open_queue > 0) {
+        setsockopt(socket_descriptor, IPPROTO_TCP, TCP_FASTOPEN, &configuration.fast_open_queue, sizeof(configuration.fast_open_queue));
+    }
+}
+
+/**
+ * Opens a TCP socket listening on the given port of all the interfaces (or
+ * takes the inherited one already bound to it), and adds it to the listeners
+ * the server accepts connections from.
+ *
+ * @param port the port number to listen on
+ * @param tls whether the connections accepted from this socket use TLS
+ *
+ * @return 0 if the socket is listening and 1 otherwise.
+ */
+int open_tcp_listener(int port, bool tls) {
+    if(listener_count == MAX_LISTENERS) return 1;
+
+    // Reuse the socket handed over by the replaced process, so no connection is refused in between
+    for(int i = 0; i < inherited_listener_count; i++) {
+        struct sockaddr_in address;
+        socklen_t address_length = sizeof(address);
+        if(inherited_listeners[i] >= 0
+           && getsockname(inherited_listeners[i], (struct sockaddr *) &address, &address_length) == 0
+           && address.sin_family == AF_INET && ntohs(address.sin_port) == port) {
+            tune_tcp_listener(inherited_listeners[i]);
+            listeners[listener_count].socket_descriptor = inherited_listeners[i];
+            listeners[listener_count].tls = tls;
+            listener_count++;
+            inherited_listeners[i] = -1;
+            return 0;
+        }
+    }
+
+    int socket_descriptor = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_descriptor == -1) {
+        printf("[Server] Could not create the socket\n");
+        fflush(stdout);
+        return 1;
+    }
+
+    // Restarting must not wait for the connections of the previous process to leave TIME_WAIT
+    int enabled = 1;
+    setsockopt(socket_descriptor, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+
+    struct sockaddr_in server;
+
+    // Set socket to TCP, assign ADDRESS and set PORT number
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(port);
+
+    // Assign address to server socket
+    if (bind(socket_descriptor, (struct sockaddr *) &server, sizeof(server)) < 0) {
+        printf("[Server] Binding has failed\n");
+        fflush(stdout);
+        close(socket_descriptor);
+        return 1;
+    }
+    tune_tcp_listener(socket_descriptor);
+    if (listen(socket_descriptor, configuration.listen_backlog) < 0) {
+        printf("[Server] Listening has failed\n");
+        fflush(stdout);
+        close(socket_descriptor);
+        return 1;
+    }
+
+    listeners[listener_count].socket_descriptor = socket_descriptor;
+    listeners[listener_count].tls = tls;
+    listener_count++;
+    return 0;
+}
+
+/**
+ * Opens a Unix domain stream socket listening at the given path (or takes
+ * the inherited one already bound to it), and adds it to the listeners the
+ * server accepts connections from. A path starting with '@' is bound in the
+ * abstract namespace, otherwise a stale socket file left at the path (one
+ * nothing listens on) is replaced and the new one gets the given permissions.
+ *
+ * @param path the path of the socket
+ * @param mode the permissions of the socket file
+ *
+ * @return 0 if the socket is listening and 1 otherwise.
+ */
+int open_unix_listener(const char * path, mode_t mode) {
+    if(listener_count == MAX_LISTENERS) return 1;
+
+    struct sockaddr_un server;
+    memset(&server, 0, sizeof(server));
+    server.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(server.sun_path)) {
+        printf("[Server] The unix socket path %s is too long\n", path);
+        fflush(stdout);
+        return 1;
+    }
+    strcpy(server.sun_path, path);
+    bool abstract = path[0] == '@';
+    // Abstract names start with a null byte and are not null terminated
+    if(abstract) server.sun_path[0] = '\0';
+    socklen_t server_length = offsetof(struct sockaddr_un, sun_path) + strlen(path) + (abstract ? 0 : 1);
+
+    // Reuse the socket handed over by the replaced process, so no connection is refused in between
+    for(int i = 0; i < inherited_listener_count; i++) {
+        struct sockaddr_un address;
+        socklen_t address_length = sizeof(address);
+        if(inherited_listeners[i] >= 0
+           && getsockname(inherited_listeners[i], (struct sockaddr *) &address, &address_length) == 0
+           && address.sun_family == AF_UNIX && address_length == server_length
+           && memcmp(address.sun_path, server.sun_path, server_length - offsetof(struct sockaddr_un, sun_path)) == 0) {
+            fcntl(inherited_listeners[i], F_SETFL, fcntl(inherited_listeners[i], F_GETFL) | O_NONBLOCK);
+            listeners[listener_count].socket_descriptor = inherited_listeners[i];
+            listeners[listener_count].tls = false;
+            listener_count++;
+            inherited_listeners[i] = -1;
+            return 0;
+        }
+    }
+
+    int socket_descriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket_descriptor == -1) {
+        printf("[Server] Could not create the unix socket\n");
+        fflush(stdout);
+        return 1;
+    }
+
+    // A socket file left by a server that did not exit cleanly would make binding fail, it is only
+    // removed when nothing listens on it anymore, a running server keeps its path and binding fails
+    struct stat file_status;
+    if(!abstract && lstat(path, &file_status) == 0 && S_ISSOCK(file_status.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(probe >= 0 && connect(probe, (struct sockaddr *) &server, server_length) != 0 && errno == ECONNREFUSED) {
+            unlink(path);
+        }
+        if(probe >= 0) close(probe);
+    }
+
+    // The permissions are set before listening, so no client can connect in between
+    if (bind(socket_descriptor, (struct sockaddr *) &server, server_length) < 0
+        || (!abstract && chmod(path, mode) != 0)) {
+        printf("[Server] Binding the unix socket %s has failed\n", path);
+        fflush(stdout);
+        close(socket_descriptor);
+        return 1;
+    }
+    if (listen(socket_descriptor, configuration.listen_backlog) < 0) {
+        printf("[Server] Listening has failed\n");
+        fflush(stdout);
+        close(socket_descriptor);
+        return 1;
+    }
+
+    listeners[listener_count].socket_descriptor = socket_descriptor;
+    listeners[listener_count].tls = false;
+    listener_count++;
+    return 0;
+}
+
+/**
+ * Hashes the given rate limiting key with the random seed of the table, so
+ * clients can not pick addresses that collide on purpose.
+ *
+ * @param address the client address (IPv4 addresses are mapped into IPv6)
+ * @param route the route the bucket applies to (0 for the per-client bucket)
+ *
+ * @return the hash of the key
+ */
+uint64_t hash_rate_limit_key(const unsigned char address[16], uint32_t route) {
+    uint64_t high;
+    uint64_t low;
+    memcpy(&high, address, 8);
+    memcpy(&low, address + 8, 8);
+    uint64_t hash = rate_limit_table.seed ^ route;
+    uint64_t words[2] = { high, low };
+    for(int i = 0; i < 2; i++) {
+        hash ^= words[i];
+        hash *= 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 32;
+    }
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * Allocates the rate limiting table with room for the configured number of
+ * buckets. The memory used is fixed, when a set is full the least recently
+ * used bucket of the set is evicted.
+ *
+ * @return 0 if the table was allocated and 1 otherwise.
+ */
+int create_rate_limit_table() {
+    rate_limit_table.set_count = (configuration.rate_limit_entries + RATE_LIMIT_WAYS - 1) / RATE_LIMIT_WAYS;
+    rate_limit_table.entries = calloc((size_t) rate_limit_table.set_count * RATE_LIMIT_WAYS, sizeof(HttpRateLimitEntry));
+    if(rate_limit_table.entries == NULL) {
+        fprintf(stderr, "Failed to allocate memory for rate limiting: %s\n", strerror(errno));
+        fflush(stderr);
+        return 1;
+    }
+    for(int i = 0; i < RATE_LIMIT_LOCKS; i++) {
+        pthread_mutex_init(&rate_limit_table.locks[i], NULL);
+    }
+    if(getrandom(&rate_limit_table.seed, sizeof(rate_limit_table.seed), 0) != sizeof(rate_limit_table.seed)) {
+        rate_limit_table.seed = monotonic_milliseconds() ^ (uint64_t) getpid() << 32;
+    }
+    return 0;
+}
+
+/**
+ * Takes one token from the bucket of the given client (and route), creating
+ * the bucket full if the client was not tracked. Buckets refill at the given
+ * rate up to the given burst.
+ *
+ * Only the lock of the set the key hashes to is held, so lookups of different
+ * clients rarely contend.
+ *
+ * @param address the client address (IPv4 addresses are mapped into IPv6)
+ * @param route the route the bucket applies to (0 for the per-client bucket)
+ * @param rate the number of requests per second allowed
+ * @param burst the number of requests allowed at once
+ *
+ * @return true if the request is allowed, false if it exceeds the limit
+ */
+bool take_rate_limit_token(const unsigned char address[16], uint32_t route, int rate, int burst) {
+    uint64_t hash = hash_rate_limit_key(address, route);
+    uint64_t set = hash % rate_limit_table.set_count;
+    HttpRateLimitEntry * entries = &rate_limit_table.entries[set * RATE_LIMIT_WAYS];
+    pthread_mutex_t * set_lock = &rate_limit_table.locks[set % RATE_LIMIT_LOCKS];
+    uint64_t now = monotonic_milliseconds();
+    int64_t capacity = (int64_t) burst * 1000;
+
+    pthread_mutex_lock(set_lock);
+
+    // Find the bucket of the key, or else the least recently used bucket of the set
+    HttpRateLimitEntry * entry = NULL;
+    HttpRateLimitEntry * victim = &entries[0];
+    for(int i = 0; i < RATE_LIMIT_WAYS && entry == NULL; i++) {
+        if(entries[i].updated != 0 && entries[i].route == route && memcmp(entries[i].address, address, 16) == 0) {
+            entry = &entries[i];
+        } else if(entries[i].updated < victim->updated) {
+            victim = &entries[i];
+        }
+    }
+
+    if(entry == NULL) {
+        entry = victim;
+        memcpy(entry->address, address, 16);
+        entry->route = route;
+        entry->tokens = capacity;
+    } else {
+        // Tokens are kept in thousandths so slow rates still refill between close requests
+        int64_t refilled = entry->tokens + (int64_t) (now - entry->updated) * rate;
+        entry->tokens = refilled < capacity ? refilled : capacity;
+    }
+    entry->updated = now;
+
+    bool allowed = entry->tokens >= 1000;
+    if(allowed) entry->tokens -= 1000;
+
+    pthread_mutex_unlock(set_lock);
+    return allowed;
+}
+
+/**
+ * Returns the rate limited route whose prefix matches the given uri.
+ *
+ * @param uri the requested uri
+ *
+ * @return a pointer to the matching <B>HttpRateLimitRoute</B>, or <I>NULL</I>
+ *         if the uri has no route specific limit
+ */
+HttpRateLimitRoute * find_rate_limit_route(char * uri) {
+    HttpRateLimitRoute * route = rate_limit_routes;
+    while(route != NULL) {
+        if(strncmp(uri, route->prefix, strlen(route->prefix)) == 0) return route;
+        route = route->next;
+    }
+    return NULL;
+}
+
+/**
+ * Extracts the rate limiting key of the given client address, IPv4
+ * addresses are mapped into IPv6 ones.
+ *
+ * @param address the address of an accepted client
+ * @param key the 16 bytes where the key is stored
+ *
+ * @return true if the key was extracted, false if the address is not an IP address
+ */
+bool rate_limit_key(struct sockaddr_storage * address, unsigned char key[16]) {
+    if(address->ss_family == AF_INET6) {
+        memcpy(key, &((struct sockaddr_in6 *) address)->sin6_addr, 16);
+        return true;
+    }
+    if(address->ss_family == AF_INET) {
+        memset(key, 0, 10);
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &((struct sockaddr_in *) address)->sin_addr, 4);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Sets the configuration value with the given name. Repeating "route" adds
+ * one more reverse proxy route every time, and repeating "rate_limit_route"
+ * one more route specific rate limit.
+ *
+ * @param name the name of the configuration value
+ * @param value the textual value
+ *
+ * @return 0 if the value was set and 1 if the name is unknown or the value is invalid
+ */
+int set_configuration_value(const char * name, const char * value) {
+    char * end = NULL;
+    long number = strtol(value, &end, 10);
+    bool is_number = (* value) != '\0' && (* end) == '\0';
+
+    if(strcmp(name, "public_folder") == 0 && (* value) != '\0') {
+        configuration.public_folder = strdup(value);
+        return configuration.public_folder == NULL;
+    } else if(strcmp(name, "port") == 0 && is_number && number >= 0 && number < 65536) {
+        configuration.port = number;
+    } else if(strcmp(name, "buffer_size") == 0 && is_number && number >= 1024 && number <= 1048576) {
+        configuration.buffer_size = number;
+    } else if(strcmp(name, "max_connections") == 0 && is_number && number > 0 && number <= INT_MAX) {
+        configuration.max_connections = number;
+    } else if(strcmp(name, "listen_backlog") == 0 && is_number && number > 0 && number <= 65535) {
+        configuration.listen_backlog = number;
+    } else if(strcmp(name, "defer_accept") == 0 && is_number && number >= 0 && number <= 3600) {
+        configuration.defer_accept = number;
+    } else if(strcmp(name, "fast_open_queue") == 0 && is_number && number >= 0 && number <= 65535) {
+        configuration.fast_open_queue = number;
+    } else if(strcmp(name, "incoming_cpu_affinity") == 0 && is_number && (number == 0 || number == 1)) {
+        configuration.incoming_cpu_affinity = number;
+    } else if(strcmp(name, "unix_socket") == 0 && (* value) != '\0') {
+        configuration.unix_socket = strdup(value);
+        return configuration.unix_socket == NULL;
+    } else if(strcmp(name, "unix_socket_mode") == 0) {
+        // Permissions are written in octal, like for chmod
+        long mode = strtol(value, &end, 8);
+        if((* value) == '\0' || (* end) != '\0' || mode < 0 || mode > 0777) return 1;
+        configuration.unix_socket_mode = mode;
+    } else if(strcmp(name, "drain_timeout") == 0 && is_number && number >= 0 && number <= INT_MAX) {
+        configuration.drain_timeout = number;
+    } else if(strcmp(name, "tls_port") == 0 && is_number && number >= 0 && number < 65536) {
+        configuration.tls_port = number;
+    } else if(strcmp(name, "tls_certificate") == 0 && (* value) != '\0') {
+        configuration.tls_certificate = strdup(value);
+        return configuration.tls_certificate == NULL;
+    } else if(strcmp(name, "tls_private_key") == 0 && (* value) != '\0') {
+        configuration.tls_private_key = strdup(value);
+        return configuration.tls_private_key == NULL;
+    } else if(strcmp(name, "rate_limit") == 0) {
+        int rate;
+        int burst;
+        char extra;
+        if(sscanf(value, "%d %d %c", &rate, &burst, &extra) != 2 || rate < 0 || burst < 1) return 1;
+        configuration.rate_limit_rate = rate;
+        configuration.rate_limit_burst = burst;
+    } else if(strcmp(name, "rate_limit_entries") == 0 && is_number && number >= RATE_LIMIT_WAYS && number <= INT_MAX) {
+        configuration.rate_limit_entries = number;
+    } else if(strcmp(name, "rate_limit_route") == 0) {
+        char prefix[256];
+        int rate;
+        int burst;
+        char extra;
+        if(sscanf(value, "%255s %d %d %c", prefix, &rate, &burst, &extra) != 3 || prefix[0] != '/' || rate < 0 || burst < 1) return 1;
+        HttpRateLimitRoute * route = calloc(1, sizeof(HttpRateLimitRoute));
+        if(route == NULL || (route->prefix = strdup(prefix)) == NULL) {
+            free(route);
+            return 1;
+        }
+        route->rate = rate;
+        route->burst = burst;
+        // Route ids start at 1, 0 is the id of the per-client buckets
+        HttpRateLimitRoute ** last_route = &rate_limit_routes;
+        route->id = 1;
+        while((* last_route) != NULL) {
+            route->id = (* last_route)->id + 1;
+            last_route = &(* last_route)->next;
+        }
+        (* last_route) = route;
+    } else if(strcmp(name, "trace_sample_rate") == 0 && is_number && number >= 0 && number <= INT_MAX) {
+        configuration.trace_sample_rate = number;
+    } else if(strcmp(name, "trace_slow_ms") == 0 && is_number && number >= 0 && number <= INT_MAX) {
+        configuration.trace_slow_ms = number;
+    } else if(strcmp(name, "trace_buffer_records") == 0 && is_number && number > 0 && number <= 16777216) {
+        configuration.trace_buffer_records = number;
+    } else if(strcmp(name, "trace_file") == 0 && (* value) != '\0') {
+        configuration.trace_file = strdup(value);
+        return configuration.trace_file == NULL;
+    } else if(strcmp(name, "warm_up_budget") == 0 && is_number && number >= 0 && number <= INT_MAX) {
+        configuration.warm_up_budget = number;
+    } else if(strcmp(name, "warm_up_threads") == 0 && is_number && number > 0 && number <= 64) {
+        configuration.warm_up_threads = number;
+    } else if(strcmp(name, "warm_up_timeout") == 0 && is_number && number >= 0 && number <= INT_MAX) {
+        configuration.warm_up_timeout = number;
+    } else if(strcmp(name, "warm_up_manifest") == 0 && (* value) != '\0') {
+        configuration.warm_up_manifest = strdup(value);
+        return configuration.warm_up_manifest == NULL;
+    } else if(strcmp(name, "route") == 0) {
+        HttpRoute * route = create_http_route(value);
+        if(route == NULL) return 1;
+        HttpRoute ** last_route = &routes;
+        while((* last_route) != NULL) last_route = &(* last_route)->next;
+        (* last_route) = route;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Loads the configuration file at the given path. Every line has the form
+ * "name = value", empty lines and lines starting with '#' are ignored.
+ *
+ * @param path the path of the configuration file
+ *
+ * @return 0 if the whole file was loaded and 1 otherwise.
+ */
+int load_configuration_file(const char * path) {
+    FILE * file = fopen(path, "r");
+    if(file == NULL) {
+        fprintf(stderr, "Failed to open configuration file %s: %s\n", path, strerror(errno));
+        fflush(stderr);
+        return 1;
+    }
+
+    char line[1024];
+    int line_number = 0;
+    int result = 0;
+    while(result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+
+        // Trim the line and split it at the first '='
+        char * name = line;
+        while(isspace((unsigned char) (* name))) name++;
+        char * line_end = name + strlen(name);
+        while(line_end > name && isspace((unsigned char) line_end[-1])) line_end--;
+        (* line_end) = '\0';
+        if((* name) == '\0' || (* name) == '#') continue;
+
+        char * value = strchr(name, '=');
+        char * name_end = value;
+        if(value != NULL) {
+            value++;
+            while(isspace((unsigned char) (* value))) value++;
+            while(name_end > name && isspace((unsigned char) name_end[-1])) name_end--;
+            (* name_end) = '\0';
+        }
+
+        if(value == NULL || set_configuration_value(name, value) != 0) {
+            fprintf(stderr, "Invalid configuration at %s:%d\n", path, line_number);
+            fflush(stderr);
+            result = 1;
+        }
+    }
+
+    fclose(file);
+    return result;
+}
+
+/**
+ * Loads the configuration from the command line, which accepts
+ * "--config <path>" to load a configuration file and "--<name>=<value>"
+ * to set single values. Arguments are applied in order, so later ones
+ * override earlier ones.
+ *
+ * @param argc the number of arguments
+ * @param argv the arguments
+ *
+ * @return 0 if the whole command line was loaded and 1 otherwise.
+ */
+int load_command_line(int argc, char * argv[]) {
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            if(load_configuration_file(argv[++i]) != 0) return 1;
+            continue;
+        }
+
+        char * separator = strchr(argv[i], '=');
+        if(strncmp(argv[i], "--", 2) != 0 || separator == NULL) {
+            fprintf(stderr, "Invalid argument: %s\n", argv[i]);
+            fflush(stderr);
+            return 1;
+        }
+
+        (* separator) = '\0';
+        int result = set_configuration_value(argv[i] + 2, separator + 1);
+        (* separator) = '=';
+        if(result != 0) {
+            fprintf(stderr, "Invalid argument: %s\n", argv[i]);
+            fflush(stderr);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Records that a reload was requested, the accept loop performs it.
+ *
+ * @param signal_number the received signal
+ */
+void request_reload(int signal_number) {
+    (void) signal_number;
+    reload_requested = 1;
+}
+
+/**
+ * Records that a dump of the request traces was requested, the accept loop
+ * performs it.
+ *
+ * @param signal_number the received signal
+ */
+void request_trace_dump(int signal_number) {
+    (void) signal_number;
+    dump_requested = 1;
+}
+
+/**
+ * Receives the listening sockets handed over by the process being replaced
+ * through the given descriptor. They are claimed later by the listeners
+ * bound to the same addresses.
+ *
+ * @param handoff_descriptor the descriptor of the handoff unix socket
+ *
+ * @return 0 if the sockets were received and 1 otherwise.
+ */
+int receive_listeners(int handoff_descriptor) {
+    char count;
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    struct iovec data = { &count, 1 };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    if(recvmsg(handoff_descriptor, &message, MSG_CMSG_CLOEXEC) != 1) return 1;
+
+    struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+    if(header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) return 1;
+    inherited_listener_count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(inherited_listeners, CMSG_DATA(header), inherited_listener_count * sizeof(int));
+    return 0;
+}
+
+/**
+ * Sends the listening sockets of this process through the given descriptor
+ * to the process replacing it.
+ *
+ * @param handoff_descriptor the descriptor of the handoff unix socket
+ *
+ * @return 0 if the sockets were sent and 1 otherwise.
+ */
+int send_listeners(int handoff_descriptor) {
+    char count = listener_count;
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    memset(control, 0, sizeof(control));
+    struct iovec data = { &count, 1 };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * listener_count);
+
+    struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * listener_count);
+    for(int i = 0; i < listener_count; i++) {
+        memcpy(CMSG_DATA(header) + i * sizeof(int), &listeners[i].socket_descriptor, sizeof(int));
+    }
+
+    return sendmsg(handoff_descriptor, &message, MSG_NOSIGNAL) == 1 ? 0 : 1;
+}
+
+/**
+ * Starts a new server process from the given executable (which may have been
+ * upgraded on disk) with the same arguments, so it reloads the configuration,
+ * and hands it the listening sockets. Both processes accept connections until
+ * the new one reports it is ready through the returned descriptor.
+ *
+ * @param executable the path of the server executable
+ * @param argv the arguments this process was started with
+ * @param replacement set to the process id of the new process
+ *
+ * @return the descriptor of the handoff unix socket, or -1 if the new process could not be started
+ */
+int start_replacement(char * executable, char * argv[], pid_t * replacement) {
+    int handoff[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, handoff) != 0) return -1;
+
+    // The environment of the new process is built here, since setenv is not safe while other threads run
+    size_t environment_size = 0;
+    while(environ[environment_size] != NULL) environment_size++;
+    char ** environment = malloc((environment_size + 2) * sizeof(char *));
+    if(environment == NULL) {
+        close(handoff[0]);
+        close(handoff[1]);
+        return -1;
+    }
+    char descriptor[sizeof(HANDOFF_VARIABLE) + 16];
+    snprintf(descriptor, sizeof(descriptor), "%s=%d", HANDOFF_VARIABLE, handoff[1]);
+    size_t variables = 0;
+    for(size_t i = 0; i < environment_size; i++) {
+        if(strncmp(environ[i], HANDOFF_VARIABLE "=", sizeof(HANDOFF_VARIABLE)) == 0) continue;
+        environment[variables++] = environ[i];
+    }
+    environment[variables++] = descriptor;
+    environment[variables] = NULL;
+
+    (* replacement) = fork();
+    if((* replacement) == 0) {
+        // Only async signal safe calls are allowed between fork and exec in a threaded process
+        fcntl(handoff[1], F_SETFD, 0);
+        execve(executable, argv, environment);
+        _exit(127);
+    }
+
+    free(environment);
+    close(handoff[1]);
+    if((* replacement) < 0 || send_listeners(handoff[0]) != 0) {
+        close(handoff[0]);
+        return -1;
+    }
+    return handoff[0];
+}
+
+/**
+ * Stops accepting connections and waits until all the open connections are
+ * closed (or the drain timeout expires) before exiting. Used once the process
+ * replacing this one is ready.
+ */
+void drain_and_exit() {
+    for(int i = 0; i < listener_count; i++) {
+        close(listeners[i].socket_descriptor);
+    }
+
+    printf("[Server] Replacement ready, draining %d open connections\n", __atomic_load_n(&open_connections, __ATOMIC_RELAXED));
+    fflush(stdout);
+
+    uint64_t deadline = monotonic_milliseconds() + configuration.drain_timeout;
+    struct timespec pause = { 0, 100000000L };
+    while(__atomic_load_n(&open_connections, __ATOMIC_RELAXED) > 0 && monotonic_milliseconds() < deadline) {
+        nanosleep(&pause, NULL);
+    }
+
+    printf("[Server] Drained, exiting\n");
+    fflush(stdout);
+    exit(0);
+}
+
+/**
+ * Handles the client request and sends a response.
+ *
+ * @param argument the <B>HttpConnection</B> to whom send a response.
+ *
+ * @return a pointer to this method
+ */
+void * handle_request(void * argument) {
+
+    // Get the client connection.
+    HttpConnection * connection = (HttpConnection *) argument;
+
+    sem_wait(&lock);
+
+    // If we run out of available connections reject connection
+    if(current_connections + 1 > configuration.max_connections) {
+        sem_post(&lock);
+        send_http_header(connection, 503, NULL);
+        free_http_connection(connection);
+        pthread_exit(NULL);
+    } else {
+        current_connections++;
+    }
+
+    sem_post(&lock);
+
+#ifdef ENABLE_TLS
+    if(connection->tls != NULL) {
+        if(accept_tls_connection(connection) != 0) {
+            printf("[Server] TLS handshake failed\n");
+            fflush(stdout);
+            free_http_connection(connection);
+            sem_wait(&lock);
+            current_connections--;
+            sem_post(&lock);
+            pthread_exit(NULL);
+        }
+        printf("[Server] TLS handshake completed (%s, session %s, kernel TLS send: %s, receive: %s)\n",
+               SSL_get_version(connection->tls), SSL_session_reused(connection->tls) ? "resumed" : "new",
+               connection->ktls_send ? "yes" : "no", connection->ktls_receive ? "yes" : "no");
+    }
+#endif
+
+    // Read the entire client message to a pooled buffer
+    HttpBuffer * message = NULL;
+    int request = receive_http_message(connection, &message);
+    char * client_message = message != NULL ? message->data : NULL;
+
+    if(request < 0) {
+        if(connection->timer.expired) {
+            printf("[Server] Client exceeded the %s timeout and was disconnected\n", connection->timer.deadline);
+        } else {
+            printf("[Server] Client message reception failed\n");
+        }
+    }
+    else if (request == 0) {
+        printf("[Server] Client disconnected unexpectedly and closed the connection\n");
+    }
+    else {
+        int parse_status;
+        HttpRequest * http_request = parse_http_request(client_message, &parse_status);
+        trace_stage(connection, TRACE_PARSED);
+
+        // Printing status to the console
+        printf("\n");
+        printf("1. Parse parse_status: %d\n", parse_status);
+        if(parse_status == 0) {
+            printf("2. Request method: %s\n", http_request->method);
+            printf("3. URI: %s\n", http_request->uri);
+            printf("4. Http Version: %s\n", http_request->version);
+            printf("5. Http Headers:\n");
+            HttpHeader * header = http_request->headers;
+            while(header != NULL) {
+                printf("   - %s : %s\n", header->name, header->value);
+                header = header->next;
+            }
+            printf("6. Body: %s\n", http_request->body);
+
+        }
+        printf("\n");
+        fflush(stdout);
+        // END
+
+        // Normalize a copy of the requested path, so routes match the same file whatever its spelling
+        // ("/./a", "//a" or "/%61"), while the proxy still forwards the uri as it was received
+        char * file_path = parse_status == 0 ? strdup(http_request->uri) : NULL;
+        bool is_valid_path = file_path != NULL && normalize_uri_path(file_path) == 0;
+
+        // Routes with their own limit are checked once the path is known, still before any file or upstream I/O
+        HttpRateLimitRoute * limited_route = is_valid_path && connection->has_client_address
+                                             ? find_rate_limit_route(file_path) : NULL;
+        bool is_limited = limited_route != NULL
+                          && !take_rate_limit_token(connection->client_address, limited_route->id,
+                                                    limited_route->rate, limited_route->burst);
+
+        // If the path is valid and matches a proxy route, forward the request to an upstream
+        HttpRoute * route = is_valid_path && !is_limited ? find_http_route(file_path) : NULL;
+
+        // Only proxied requests need the received message after parsing
+        if(route == NULL) {
+            release_buffers(message);
+            message = NULL;
+        }
+        if(is_limited) {
+            send_http_header(connection, 429, NULL);
+            free_http_request(http_request);
+        }
+        else if(route != NULL) {
+            proxy_request(connection, route, http_request, client_message, request);
+            free_http_request(http_request);
+        }
+        // If the parsing was successful
+        else if(parse_status == 0) {
+
+            // Extract the extension of the requested file (from its last segment only)
+            char * extension = is_valid_path ? strrchr(strrchr(file_path, '/'), '.') : NULL;
+
+            // Extract the MIME information using the extracted file extension
+            HttpMimeType * mime_type = extension != NULL ? from_extension_mime_type(extension + 1) : NULL;
+            trace_stage(connection, TRACE_MIME_RESOLVED);
+            if(mime_type != NULL) {
+                sem_wait(&lock);
+                trace_stage(connection, TRACE_LOCK_ACQUIRED);
+                // Send the file to the client or an error response if file was not found
+                send_file(connection, file_path, mime_type);
+                sem_post(&lock);
+            } else {
+                send_http_header(connection, 400, NULL);
+            }
+
+            // Free allocated resources
+            free_http_mime_type(mime_type);
+            free(http_request);
+
+        } else {
+            send_http_header(connection, 400, NULL);
+        }
+        free(file_path);
+
+    }
+
+    if(connection->timer.expired && request > 0) {
+        printf("[Server] Client exceeded the %s timeout and was disconnected\n", connection->timer.deadline);
+    }
+
+    if(request > 0) {
+        trace_stage(connection, TRACE_LAST_BYTE);
+        finish_trace(connection);
+    }
+    release_buffers(message);
+
+    // Close connection and finish thread
+    fflush(stdout);
+    free_http_connection(connection);
+    sem_wait(&lock);
+    current_connections--;
+    sem_post(&lock);
+    pthread_exit(NULL);
+}
+
+int main(int argc, char *argv[]) {
+
+    // Converting a trace file does not start the server
+    if(argc == 3 && strcmp(argv[1], "--trace-to-json") == 0) {
+        return convert_trace_to_json(argv[2]);
+    }
+
+    sem_init(&lock, 0, 1);
+
+    // Remember which executable to start on reload, even if it gets replaced on disk by an upgrade
+    char * executable = realpath("/proc/self/exe", NULL);
+
+    // SIGHUP and SIGUSR1 are only handled by this thread while it waits for connections
+    sigset_t reload_signals;
+    sigset_t waiting_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    sigaddset(&reload_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &reload_signals, &waiting_signals);
+    sigdelset(&waiting_signals, SIGHUP);
+    sigdelset(&waiting_signals, SIGUSR1);
+    struct sigaction reload_action;
+    memset(&reload_action, 0, sizeof(reload_action));
+    reload_action.sa_handler = request_reload;
+    sigaction(SIGHUP, &reload_action, NULL);
+    struct sigaction dump_action;
+    memset(&dump_action, 0, sizeof(dump_action));
+    dump_action.sa_handler = request_trace_dump;
+    sigaction(SIGUSR1, &dump_action, NULL);
+
+    // Start the timer wheel that enforces the deadlines of every connection
+    pthread_mutex_init(&timer_wheel.mutex, NULL);
+    timer_wheel.current = monotonic_milliseconds() / TIMER_TICK_MS;
+    pthread_t timer_thread;
+    if(pthread_create(&timer_thread, NULL, run_timer_wheel, NULL) != 0) {
+        printf("[Server] Could not create the timer thread\n");
+        fflush(stdout);
+        return 1;
+    }
+
+    // Writes to sockets closed by the peer must fail with EPIPE instead of killing the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Build the default reverse proxy routes, keeping the order in which they were defined
+    static const char * proxy_routes[] = PROXY_ROUTES;
+    HttpRoute ** last_route = &routes;
+    for(int i = 0; proxy_routes[i] != NULL; i++) {
+        HttpRoute * route = create_http_route(proxy_routes[i]);
+        if(route == NULL) {
+            printf("[Server] Could not create the proxy routes\n");
+            fflush(stdout);
+            return 1;
+        }
+        (* last_route) = route;
+        last_route = &route->next;
+    }
+
+    if(load_command_line(argc, argv) != 0) {
+        printf("[Server] Could not load the configuration\n");
+        fflush(stdout);
+        return 1;
+    }
+
+    // When replacing another process, take over its listening sockets
+    char * handoff_variable = getenv(HANDOFF_VARIABLE);
+    int inherited_handoff = handoff_variable != NULL ? atoi(handoff_variable) : -1;
+    if(inherited_handoff >= 0) {
+        unsetenv(HANDOFF_VARIABLE);
+        fcntl(inherited_handoff, F_SETFD, FD_CLOEXEC);
+        if(receive_listeners(inherited_handoff) != 0) {
+            printf("[Server] Could not receive the listening sockets\n");
+            fflush(stdout);
+            return 1;
+        }
+    }
+
+    if((configuration.rate_limit_rate > 0 || rate_limit_routes != NULL) && create_rate_limit_table() != 0) return 1;
+
+    if((configuration.trace_sample_rate > 0 || configuration.trace_slow_ms > 0) && create_trace_rings() != 0) return 1;
+
+    public_folder_descriptor = open(configuration.public_folder, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(public_folder_descriptor < 0) {
+        printf("[Server] Could not open the public folder %s\n", configuration.public_folder);
+        fflush(stdout);
+        return 1;
+    }
+
+    // Connections are only accepted once the files are warm (a replaced process keeps serving meanwhile)
+    if(configuration.warm_up_budget > 0) warm_up_public_folder();
+
+    if(configuration.port > 0 && open_tcp_listener(configuration.port, false) != 0) return 1;
+    if(configuration.unix_socket != NULL && open_unix_listener(configuration.unix_socket, configuration.unix_socket_mode) != 0) return 1;
+
+#ifdef ENABLE_TLS
+    if(configuration.tls_port > 0) {
+        tls_context = create_tls_context();
+        if(tls_context == NULL) {
+            printf("[Server] Could not load the TLS certificate and private key\n");
+            fflush(stdout);
+            return 1;
+        }
+        if(open_tcp_listener(configuration.tls_port, true) != 0) return 1;
+    }
+#endif
+
+    if(listener_count == 0) {
+        printf("[Server] No port or unix socket to listen on\n");
+        fflush(stdout);
+        return 1;
+    }
+
+    // Inherited sockets that are no longer configured stay with the replaced process only
+    for(int i = 0; i < inherited_listener_count; i++) {
+        if(inherited_listeners[i] >= 0) close(inherited_listeners[i]);
+    }
+
+    // Tell the replaced process it can stop accepting connections
+    if(inherited_handoff >= 0) {
+        write(inherited_handoff, "R", 1);
+        close(inherited_handoff);
+    }
+
+    printf("[Server] Waiting for incoming connections...\n");
+    fflush(stdout);
+
+    // The last entry waits for the readiness of a replacement process while a reload is in progress
+    struct pollfd ready[MAX_LISTENERS + 1];
+    for(int i = 0; i < listener_count; i++) {
+        ready[i].fd = listeners[i].socket_descriptor;
+        ready[i].events = POLLIN;
+    }
+    ready[listener_count].fd = -1;
+    ready[listener_count].events = POLLIN;
+    pid_t replacement = -1;
+
+    while (true) {
+        if(dump_requested) {
+            dump_requested = 0;
+            print_buffer_statistics();
+            dump_traces();
+        }
+        if(reload_requested) {
+            reload_requested = 0;
+            if(ready[listener_count].fd < 0 && executable != NULL) {
+                printf("[Server] Reloading, starting a new process\n");
+                fflush(stdout);
+                ready[listener_count].fd = start_replacement(executable, argv, &replacement);
+            }
+        }
+
+        if(ppoll(ready, listener_count + 1, NULL, &waiting_signals) < 0) {
+            if(errno == EINTR) continue;
+            printf("[Server] Waiting for connections has failed\n");
+            fflush(stdout);
+            return 1;
+        }
+
+        if(ready[listener_count].fd >= 0 && ready[listener_count].revents != 0) {
+            char status;
+            if(read(ready[listener_count].fd, &status, 1) == 1) drain_and_exit();
+            // The new process exited before becoming ready, keep serving
+            printf("[Server] Reload failed, the new process did not start\n");
+            fflush(stdout);
+            close(ready[listener_count].fd);
+            ready[listener_count].fd = -1;
+            waitpid(replacement, NULL, 0);
+        }
+
+        // Drain every ready listener in batches, so one busy listener can not starve the others
+        for(int i = 0; i < listener_count; i++) {
+            if((ready[i].revents & POLLIN) == 0) continue;
+
+            for(int accepted = 0; accepted < ACCEPT_BATCH_SIZE; accepted++) {
+                struct sockaddr_storage client;
+                socklen_t client_length = sizeof(client);
+                // Accepted sockets stay blocking, the handler threads use blocking I/O
+                int new_socket = accept4(listeners[i].socket_descriptor, (struct sockaddr *) &client, &client_length, SOCK_CLOEXEC);
+                if(new_socket < 0 && (errno == EINTR || errno == ECONNABORTED)) continue;
+                if(new_socket < 0) break;
+
+                // Reject clients over their rate limit right away, without a thread, parsing or file I/O
+                unsigned char client_address[16];
+                bool has_client_address = rate_limit_table.entries != NULL && rate_limit_key(&client, client_address);
+                if(has_client_address && configuration.rate_limit_rate > 0
+                   && !take_rate_limit_token(client_address, 0, configuration.rate_limit_rate, configuration.rate_limit_burst)) {
+                    static const char response[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+                    send(new_socket, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+                    // Closing with the request still unread would reset the connection and could discard the
+                    // response on the client side, so whatever already arrived is read (without ever waiting)
+                    shutdown(new_socket, SHUT_WR);
+                    char discarded[4096];
+                    for(int reads = 0; reads < 4 && recv(new_socket, discarded, sizeof(discarded), MSG_DONTWAIT) > 0; reads++);
+                    close(new_socket);
+                    continue;
+                }
+
+                printf("[Server] New connection accepted!\n");
+                fflush(stdout);
+
+                HttpConnection * connection = create_http_connection(new_socket);
+                if(connection == NULL) {
+                    close(new_socket);
+                    continue;
+                }
+                memcpy(connection->client_address, client_address, 16);
+                connection->has_client_address = has_client_address;
+
+#ifdef ENABLE_TLS
+                if(listeners[i].tls) {
+                    connection->tls = SSL_new(tls_context);
+                    if(connection->tls == NULL || SSL_set_fd(connection->tls, new_socket) != 1) {
+                        free_http_connection(connection);
+                        continue;
+                    }
+                    SSL_set_accept_state(connection->tls);
+                }
+#endif
+
+                // Keep the handler on the CPU that received the packets of the connection, where its socket is hot
+                pthread_attr_t job_attributes;
+                pthread_attr_init(&job_attributes);
+                int incoming_cpu;
+                socklen_t incoming_cpu_length = sizeof(incoming_cpu);
+                if(configuration.incoming_cpu_affinity
+                   && getsockopt(new_socket, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, &incoming_cpu_length) == 0
+                   && incoming_cpu >= 0 && incoming_cpu < CPU_SETSIZE) {
+                    cpu_set_t cpus;
+                    CPU_ZERO(&cpus);
+                    CPU_SET(incoming_cpu, &cpus);
+                    pthread_attr_setaffinity_np(&job_attributes, sizeof(cpus), &cpus);
+                }
+
+                // Creating a new thread that will handle each request
+                pthread_t job_thread;
+                int result = pthread_create(&job_thread, &job_attributes, handle_request, (void *) connection);
+                // The CPU may be outside of the ones this process is allowed to run on
+                if(result == EINVAL) result = pthread_create(&job_thread, NULL, handle_request, (void *) connection);
+                pthread_attr_destroy(&job_attributes);
+                if (result != 0) {
+                    // Running out of threads is transient, only this connection is dropped
+                    printf("[Server] Could not create a new thread!\n");
+                    fflush(stdout);
+                    free_http_connection(connection);
+                    continue;
+                }
+                pthread_detach(job_thread);
+            }
+        }
+    }
+
+    return 0;
+}